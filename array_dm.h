@@ -1,6 +1,11 @@
 #include "dmemory.h"
 
-#ifdef TYPE
+// Bounded arrays that never allocate, see array_fixed_dm.h.
+#ifdef DM_FIXED_CONTAINERS
+#include "array_fixed_dm.h"
+#endif
+
+#if defined(TYPE) && !defined(DM_FIXED_CONTAINERS)
 
 #ifndef CAPACITY_ARRAY
 #define CAPACITY_ARRAY 8
@@ -16,47 +21,92 @@
 #define ARRAY TEMPLATEARRAY (TYPE)
 typedef struct {
 	TYPE* start;
-	int size;
-	int capacity;
+	dm_index size;
+	dm_index capacity;
+#ifdef DM_CAPACITY_HINTS
+	int site;		// -1 if not made for a site
+	dm_index peak;	// most elements held so far
+#endif
 } ARRAY;
 
 // Generic array constructor.
 #define MAKEFUNCTION(T) TOKENPASTE(make_array_, T)
-ARRAY MAKEFUNCTION (TYPE) () {
+__DM_HEADER_FUNCTION ARRAY MAKEFUNCTION (TYPE) () {
+	ARRAY array;
+	array.capacity = CAPACITY_ARRAY;
+	array.size = 0;
+
+	array.start = (TYPE*)dmalloc_array(CAPACITY_ARRAY);
+#ifdef DM_CAPACITY_HINTS
+	array.site = -1;
+	array.peak = 0;
+#endif
+	return array;
+}
+
+// Generic constructor for an array made at a known site.
+// Starts at the capacity recorded for 'site', see 'Capacity Hints'
+// in dmemory.h.
+#define MAKESITEFUNCTION(T) TOKENPASTE(make_array_site_, T)
+__DM_HEADER_FUNCTION ARRAY MAKESITEFUNCTION (TYPE) (int site) {
+#ifdef DM_CAPACITY_HINTS
+	const dm_index hint = dm_capacity_hint(site);
 	ARRAY array;
-	array.capacity = CAPACITY;
+	array.capacity = hint > CAPACITY_ARRAY ? hint : CAPACITY_ARRAY;
 	array.size = 0;
+
+	array.start = (TYPE*)dmalloc_array(array.capacity);
+	array.site = site;
+	array.peak = 0;
 	return array;
+#else
+	(void)site;
+	return MAKEFUNCTION(TYPE)();
+#endif
 }
 
 // Generic append function.
 // Adds an element to the end of the array 
-// resizing the underlying array if needed.
+// resizing the underlying array if needed.  If there is no room to resize
+// it, the error is reported by __memory_error() and the array is left as
+// it was, without the element.
 #define APPENDFUNCTION(T) TOKENPASTE(append_, T)
-void APPENDFUNCTION (TYPE) (ARRAY* array, TYPE elem) {
+__DM_HEADER_FUNCTION void APPENDFUNCTION (TYPE) (ARRAY* array, TYPE elem) {
 	if (array->size == array->capacity) {
-		const int c = (CAPACITY / 2) + array->capacity;
+		const dm_index c = (CAPACITY_ARRAY / 2) + array->capacity;
 		TYPE* newArray = (TYPE*)dmalloc_array(c);
-		for (int i = 0; i < array->size; i++) {
+		if (newArray == NULL) {
+			return;
+		}
+		for (dm_index i = 0; i < array->size; i++) {
 			newArray[ITERATOR] = array->start[ITERATOR];
 		}
-		dmfree_array(array->start, array->capacity);
+		dmfree_array((block*)array->start, array->capacity);
 		array->start = newArray;
 		array->capacity = c;
 	}
+
+	array->start[TYPECOEF * array->size] = elem;
+	__DM_MARK_DIRTY(&array->start[TYPECOEF * array->size], 1);
+	++array->size;
+#ifdef DM_CAPACITY_HINTS
+	if (array->size > array->peak) {
+		array->peak = array->size;
+	}
+#endif
 }
 
 // Generic at function.
 // Returns the element of array at index idx.
 #define ATFUNCTION(T) TOKENPASTE(at_, T)
-TYPE ATFUNCTION (TYPE) (ARRAY* array, int idx) {
+__DM_HEADER_FUNCTION TYPE ATFUNCTION (TYPE) (ARRAY* array, dm_index idx) {
 	return array->start[TYPECOEF * idx];
 }
 
 // Genecric remove_last function.
 // Removes and returns the last element of the array.
 #define REMOVELAST(T) TOKENPASTE(remove_last_, T)
-TYPE REMOVELAST (TYPE) (ARRAY* array) {
+__DM_HEADER_FUNCTION TYPE REMOVELAST (TYPE) (ARRAY* array) {
 	--array->size;
 	return array->start[TYPECOEF * array->size];
 }
@@ -65,27 +115,94 @@ TYPE REMOVELAST (TYPE) (ARRAY* array) {
 // Removes and returns the element at index idx.
 // Elements after are moved back to close the gap.
 #define REMOVEAT(T) TOKENPASTE(remove_at_, T)
-TYPE REMOVEAT (TYPE) (ARRAY* array, int idx) {
+__DM_HEADER_FUNCTION TYPE REMOVEAT (TYPE) (ARRAY* array, dm_index idx) {
 	TYPE item = ATFUNCTION(TYPE)(array, idx);
-	for (int i = idx + 1; i < array->size; i++) {
+	for (dm_index i = idx + 1; i < array->size; i++) {
 		array->start[TYPECOEF * (i - 1)] = array->start[ITERATOR];
 	}
+	__DM_MARK_DIRTY(&array->start[TYPECOEF * idx], array->size - idx);
 	--array->size;
+	return item;
+}
+
+// Generic shrink_to_fit function.
+// Gives the unused capacity at the end of the array back to d_memory
+// without moving the elements, keeping at least one block.
+// Returns the number of blocks freed, so it can be used from a
+// reclaim callback.
+#define SHRINKFUNCTION(T) TOKENPASTE(shrink_to_fit_, T)
+__DM_HEADER_FUNCTION dm_index SHRINKFUNCTION (TYPE) (ARRAY* array) {
+	const dm_index c = array->size > 0 ? array->size : 1;
+#ifdef DM_SLAB
+	// Slab slots can only be freed whole.
+	if (array->capacity <= DM_SLAB_MAX_SLOT) {
+		return 0;
+	}
+#endif
+	if (c >= array->capacity) {
+		return 0;
+	}
+	const dm_index freed = array->capacity - c;
+	dmfree_array((block*)array->start + c, freed);
+	array->capacity = c;
+	return freed;
+}
+
+// Generic share function.
+// Swaps the array for a header in d_memory that another process or file
+// takes over with adopt_array_TYPE(), see 'Shared Memory Arena' in
+// dmemory.h.  The elements are not copied.  Returns the index of the
+// header and leaves the array without elements, to be deleted or remade,
+// or returns -1 and leaves it as it was if there is no room.
+#define SHAREFUNCTION(T) TOKENPASTE(share_array_, T)
+__DM_HEADER_FUNCTION dm_index SHAREFUNCTION (TYPE) (ARRAY* array) {
+	const dm_index handle = __handoff_store(array->size, array->capacity, array->start);
+	if (handle >= 0) {
+		array->start = NULL;
+		array->size = 0;
+		array->capacity = 0;
+	}
+	return handle;
+}
+
+// Generic adopt function.
+// Returns the array left by share_array_TYPE() at 'handle'.
+#define ADOPTFUNCTION(T) TOKENPASTE(adopt_array_, T)
+__DM_HEADER_FUNCTION ARRAY ADOPTFUNCTION (TYPE) (dm_index handle) {
+	ARRAY array;
+	array.start = (TYPE*)__handoff_take(handle, &array.size, &array.capacity);
+#ifdef DM_CAPACITY_HINTS
+	array.site = -1;
+	array.peak = 0;
+#endif
+	return array;
 }
 
 // Un-allocates the array.
 #define DELETEARRAYFUNCTION(T) TOKENPASTE(delete_array_, T)
-void DELETEARRAYFUNCTION (TYPE) (ARRAY* array) {
-	dmfree_array((block*)array->start, array->capacity);
+__DM_HEADER_FUNCTION void DELETEARRAYFUNCTION (TYPE) (ARRAY* array) {
+#ifdef DM_CAPACITY_HINTS
+	if (array->site >= 0) {
+		dm_capacity_record(array->site, array->peak);
+	}
+#endif
+	// Nothing to free once shared.
+	if (array->start != NULL) {
+		dmfree_array((block*)array->start, array->capacity);
+	}
 }
 
 
 #undef TOKENPASTE
 #undef MAKEFUNCTION
+#undef MAKESITEFUNCTION
 #undef APPENDFUNCTION
 #undef ATFUNCTION
 #undef REMOVELAST
 #undef REMOVEAT
+#undef SHRINKFUNCTION
+#undef SHAREFUNCTION
+#undef ADOPTFUNCTION
 #undef DELETEARRAYFUNCTION
 #undef ARRAY
 #undef TEMPLATEARRAY
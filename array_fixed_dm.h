@@ -0,0 +1,169 @@
+/*
+	Fixed capacity array, the bounded twin of array_dm.h.
+
+	Declares the same array_TYPE struct and functions as array_dm.h, but
+	the elements live in an array of CAPACITY_ARRAY elements inside the
+	struct.  Only share and adopt call into d_memory and append, at and
+	remove_last take constant time.  remove_at still moves the elements
+	after idx.
+
+	Defining DM_FIXED_CONTAINERS before including array_dm.h switches it to
+	this file.  Appending to a full array calls __memory_error() and drops
+	the element.
+ */
+
+#include "dmemory.h" // for dm_index, __DM_HEADER_FUNCTION and the handoff header
+
+#ifdef TYPE
+
+#ifndef CAPACITY_ARRAY
+#define CAPACITY_ARRAY 8
+#endif
+
+#define TOKENPASTE(x, y) x ## y
+
+// Generic struct declaration.
+#define TEMPLATEARRAY(T) TOKENPASTE(array_, T)
+#define ARRAY TEMPLATEARRAY (TYPE)
+typedef struct {
+	TYPE start [CAPACITY_ARRAY];
+	dm_index size;
+	dm_index capacity; // always CAPACITY_ARRAY
+} ARRAY;
+
+// Generic array constructor.
+#define MAKEFUNCTION(T) TOKENPASTE(make_array_, T)
+__DM_HEADER_FUNCTION ARRAY MAKEFUNCTION (TYPE) () {
+	ARRAY array;
+	array.capacity = CAPACITY_ARRAY;
+	array.size = 0;
+	return array;
+}
+
+// Same as make_array_TYPE(), the capacity is fixed whatever the site.
+#define MAKESITEFUNCTION(T) TOKENPASTE(make_array_site_, T)
+__DM_HEADER_FUNCTION ARRAY MAKESITEFUNCTION (TYPE) (int site) {
+	(void)site;
+	return MAKEFUNCTION(TYPE)();
+}
+
+// Generic append function.
+// Adds an element to the end of the array.  A full array calls
+// __memory_error() and drops the element.
+#define APPENDFUNCTION(T) TOKENPASTE(append_, T)
+__DM_HEADER_FUNCTION void APPENDFUNCTION (TYPE) (ARRAY* array, TYPE elem) {
+	if (array->size == CAPACITY_ARRAY) {
+		__memory_error("Array is full\n");
+		return;
+	}
+	array->start[array->size] = elem;
+	++array->size;
+}
+
+// Generic at function.
+// Returns the element of array at index idx.
+#define ATFUNCTION(T) TOKENPASTE(at_, T)
+__DM_HEADER_FUNCTION TYPE ATFUNCTION (TYPE) (ARRAY* array, dm_index idx) {
+	return array->start[idx];
+}
+
+// Genecric remove_last function.
+// Removes and returns the last element of the array.
+#define REMOVELAST(T) TOKENPASTE(remove_last_, T)
+__DM_HEADER_FUNCTION TYPE REMOVELAST (TYPE) (ARRAY* array) {
+	--array->size;
+	return array->start[array->size];
+}
+
+// Generic remove_at function.
+// Removes and returns the element at index idx.
+// Elements after are moved back to close the gap.
+#define REMOVEAT(T) TOKENPASTE(remove_at_, T)
+__DM_HEADER_FUNCTION TYPE REMOVEAT (TYPE) (ARRAY* array, dm_index idx) {
+	TYPE item = array->start[idx];
+	for (dm_index i = idx + 1; i < array->size; i++) {
+		array->start[i - 1] = array->start[i];
+	}
+	--array->size;
+	return item;
+}
+
+// Generic shrink_to_fit function.
+// The storage is part of the struct, so nothing is ever freed.
+#define SHRINKFUNCTION(T) TOKENPASTE(shrink_to_fit_, T)
+__DM_HEADER_FUNCTION dm_index SHRINKFUNCTION (TYPE) (ARRAY* array) {
+	(void)array;
+	return 0;
+}
+
+// Blocks of d_memory taken by each element when shared.
+#define ELEMENTBLOCKS ((dm_index)((sizeof(TYPE) + sizeof(block) - 1) / sizeof(block)))
+
+// Generic share function.
+// Copies the elements into d_memory under a handoff header that another
+// process or file takes over with adopt_array_TYPE(), see 'Shared Memory
+// Arena' in dmemory.h.  Unlike the growable array the elements are copied,
+// they live in the struct.  Returns the index of the header and leaves the
+// array empty, or returns -1 and leaves it as it was if there is no room.
+//
+// Each element starts a block of its own, the layout of array_dm.h, so for
+// types of up to a block a handle shared by either kind of array can be
+// adopted by the other.
+#define SHAREFUNCTION(T) TOKENPASTE(share_array_, T)
+__DM_HEADER_FUNCTION dm_index SHAREFUNCTION (TYPE) (ARRAY* array) {
+	const dm_index capacity = array->size > 0 ? array->size : 1;
+	block* data = dmalloc_array(capacity * ELEMENTBLOCKS);
+	if (data == NULL) {
+		return -1;
+	}
+	for (dm_index i = 0; i < array->size; i++) {
+		memcpy(&data[i * ELEMENTBLOCKS], &array->start[i], sizeof(TYPE));
+	}
+	const dm_index handle = __handoff_store(array->size, capacity, data);
+	if (handle < 0) {
+		dmfree_array(data, capacity * ELEMENTBLOCKS);
+		return -1;
+	}
+	array->size = 0;
+	return handle;
+}
+
+// Generic adopt function.
+// Returns the array left by share_array_TYPE() at 'handle', keeping at
+// most CAPACITY_ARRAY elements, and frees the copy in d_memory.
+#define ADOPTFUNCTION(T) TOKENPASTE(adopt_array_, T)
+__DM_HEADER_FUNCTION ARRAY ADOPTFUNCTION (TYPE) (dm_index handle) {
+	ARRAY array = MAKEFUNCTION(TYPE)();
+	dm_index size;
+	dm_index capacity;
+	block* data = __handoff_take(handle, &size, &capacity);
+	array.size = size < CAPACITY_ARRAY ? size : CAPACITY_ARRAY;
+	for (dm_index i = 0; i < array.size; i++) {
+		memcpy(&array.start[i], &data[i * ELEMENTBLOCKS], sizeof(TYPE));
+	}
+	dmfree_array(data, capacity * ELEMENTBLOCKS);
+	return array;
+}
+
+// Empties the array.
+#define DELETEARRAYFUNCTION(T) TOKENPASTE(delete_array_, T)
+__DM_HEADER_FUNCTION void DELETEARRAYFUNCTION (TYPE) (ARRAY* array) {
+	array->size = 0;
+}
+
+
+#undef TOKENPASTE
+#undef MAKEFUNCTION
+#undef MAKESITEFUNCTION
+#undef APPENDFUNCTION
+#undef ATFUNCTION
+#undef REMOVELAST
+#undef REMOVEAT
+#undef SHRINKFUNCTION
+#undef ELEMENTBLOCKS
+#undef SHAREFUNCTION
+#undef ADOPTFUNCTION
+#undef DELETEARRAYFUNCTION
+#undef ARRAY
+#undef TEMPLATEARRAY
+#endif
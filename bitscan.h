@@ -0,0 +1,226 @@
+/*
+ * Bitmap scan kernels.
+ *
+ * Helpers for scanning large bitmaps laid out like __free_memory (block n is
+ * bit n % 8 of byte n / 8, a set bit means the block is in use):
+ *
+ *      bitscan_find_not_full   skips over bytes that are 0xff, i.e. runs of
+ *                              blocks that are all in use
+ *      bitscan_popcount        counts the set bits
+ *      bitscan_load64          loads 64 blocks as a word, block n at bit n
+ *      bitscan_ctz64/clz64     count trailing / leading zero bits of a word
+ *
+ * On x86-64 with GCC or Clang the first two have AVX2 and AVX-512 versions that
+ * check 256 and 512 blocks per compare.  The best version the CPU supports
+ * is picked at run time by bitscan_select(), compiled with per function
+ * target attributes so no -mavx flags are needed.  Everywhere else, or if
+ * BITSCAN_NO_SIMD is defined, portable 64 bit versions are used.
+ */
+
+#ifndef __bitscan_h__
+#define __bitscan_h__
+
+#include <string.h> // for memcpy()
+
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(BITSCAN_NO_SIMD)
+#define __BITSCAN_X86
+#include <immintrin.h>
+#endif
+
+// Returns bytes [idx, idx + 8) as a word with the bit of block n at bit n.
+unsigned long long bitscan_load64 (const unsigned char* bits, long long idx) {
+    unsigned long long word;
+    memcpy(&word, bits + idx, sizeof(word));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+int __bitscan_popcount64 (unsigned long long word) {
+#ifdef __GNUC__
+    return __builtin_popcountll(word);
+#else
+    int count = 0;
+    while (word) {
+        word &= word - 1;
+        ++count;
+    }
+    return count;
+#endif
+}
+
+// Returns the number of trailing zero bits of a non zero word.
+int bitscan_ctz64 (unsigned long long word) {
+#ifdef __GNUC__
+    return __builtin_ctzll(word);
+#else
+    int count = 0;
+    while (!(word & 1)) {
+        word >>= 1;
+        ++count;
+    }
+    return count;
+#endif
+}
+
+// Returns the number of leading zero bits of a non zero word.
+int bitscan_clz64 (unsigned long long word) {
+#ifdef __GNUC__
+    return __builtin_clzll(word);
+#else
+    int count = 0;
+    while (!(word >> 63)) {
+        word <<= 1;
+        ++count;
+    }
+    return count;
+#endif
+}
+
+
+//===---- Portable ----===//
+
+long long __bitscan_find_not_full_scalar (const unsigned char* bits, long long from, long long end) {
+    for (; from + 8 <= end; from += 8) {
+        if (bitscan_load64(bits, from) != ~0ULL) {
+            break;
+        }
+    }
+    for (; from < end; from++) {
+        if (bits[from] != 0xff) {
+            return from;
+        }
+    }
+    return end;
+}
+
+long long __bitscan_popcount_scalar (const unsigned char* bits, long long bytes) {
+    long long count = 0;
+    long long i = 0;
+    for (; i + 8 <= bytes; i += 8) {
+        count += __bitscan_popcount64(bitscan_load64(bits, i));
+    }
+    for (; i < bytes; i++) {
+        count += __bitscan_popcount64(bits[i]);
+    }
+    return count;
+}
+
+
+//===---- AVX2 ----===//
+#ifdef __BITSCAN_X86
+
+// Compares 32 bytes (256 blocks) with 0xff at a time.
+__attribute__((target("avx2")))
+long long __bitscan_find_not_full_avx2 (const unsigned char* bits, long long from, long long end) {
+    const __m256i full = _mm256_set1_epi8((char)0xff);
+    for (; from + 32 <= end; from += 32) {
+        const __m256i v = _mm256_loadu_si256((const __m256i*)(bits + from));
+        const unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, full));
+        if (mask != 0xffffffffu) {
+            return from + __builtin_ctz(~mask);
+        }
+    }
+    return __bitscan_find_not_full_scalar(bits, from, end);
+}
+
+/*
+ * Counts bits 32 bytes at a time by looking up the count of each nibble
+ * in a 16 entry table with a byte shuffle, then summing the bytes of each
+ * 64 bit lane with a sum of absolute differences against zero.
+ */
+__attribute__((target("avx2")))
+long long __bitscan_popcount_avx2 (const unsigned char* bits, long long bytes) {
+    const __m256i table = _mm256_setr_epi8(
+            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i total = _mm256_setzero_si256();
+    long long i = 0;
+    for (; i + 32 <= bytes; i += 32) {
+        const __m256i v = _mm256_loadu_si256((const __m256i*)(bits + i));
+        const __m256i counts = _mm256_add_epi8(
+                _mm256_shuffle_epi8(table, _mm256_and_si256(v, low)),
+                _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), low)));
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(counts, _mm256_setzero_si256()));
+    }
+    long long count = _mm256_extract_epi64(total, 0) + _mm256_extract_epi64(total, 1)
+        + _mm256_extract_epi64(total, 2) + _mm256_extract_epi64(total, 3);
+    return count + __bitscan_popcount_scalar(bits + i, bytes - i);
+}
+
+
+//===---- AVX-512 ----===//
+
+// Compares 64 bytes (512 blocks) with 0xff at a time.
+__attribute__((target("avx512f,avx512bw")))
+long long __bitscan_find_not_full_avx512 (const unsigned char* bits, long long from, long long end) {
+    const __m512i full = _mm512_set1_epi8((char)0xff);
+    for (; from + 64 <= end; from += 64) {
+        const __m512i v = _mm512_loadu_si512((const void*)(bits + from));
+        const unsigned long long mask = _mm512_cmpneq_epi8_mask(v, full);
+        if (mask != 0) {
+            return from + __builtin_ctzll(mask);
+        }
+    }
+    return __bitscan_find_not_full_avx2(bits, from, end);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq")))
+long long __bitscan_popcount_avx512 (const unsigned char* bits, long long bytes) {
+    __m512i total = _mm512_setzero_si512();
+    long long i = 0;
+    for (; i + 64 <= bytes; i += 64) {
+        const __m512i v = _mm512_loadu_si512((const void*)(bits + i));
+        total = _mm512_add_epi64(total, _mm512_popcnt_epi64(v));
+    }
+    return _mm512_reduce_add_epi64(total) + __bitscan_popcount_scalar(bits + i, bytes - i);
+}
+
+#endif
+
+
+//===---- Dispatch ----===//
+
+static long long (*__bitscan_find_not_full) (const unsigned char*, long long, long long) = __bitscan_find_not_full_scalar;
+static long long (*__bitscan_popcount) (const unsigned char*, long long) = __bitscan_popcount_scalar;
+static const char* __bitscan_kernel = "scalar";
+
+// Picks the fastest kernels the CPU supports.
+// Call once before scanning, initialize_memory() does.
+void bitscan_select () {
+#ifdef __BITSCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        __bitscan_find_not_full = __bitscan_find_not_full_avx2;
+        __bitscan_popcount = __bitscan_popcount_avx2;
+        __bitscan_kernel = "avx2";
+    }
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+        __bitscan_find_not_full = __bitscan_find_not_full_avx512;
+        __bitscan_kernel = "avx512";
+    }
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq")) {
+        __bitscan_popcount = __bitscan_popcount_avx512;
+    }
+#endif
+}
+
+// Returns the name of the kernel picked by bitscan_select().
+const char* bitscan_kernel_name () {
+    return __bitscan_kernel;
+}
+
+// Returns the first byte in [from, end) that is not 0xff, or end if there
+// is none.
+long long bitscan_find_not_full (const unsigned char* bits, long long from, long long end) {
+    return __bitscan_find_not_full(bits, from, end);
+}
+
+// Returns the number of set bits in the first 'bytes' bytes.
+long long bitscan_popcount (const unsigned char* bits, long long bytes) {
+    return __bitscan_popcount(bits, bytes);
+}
+
+#endif
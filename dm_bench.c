@@ -0,0 +1,375 @@
+/*
+ * Allocator and container microbenchmarks.
+ *
+ * Build:
+ *      gcc -std=gnu99 -O2 -o dm_bench dm_bench.c
+ *
+ *      Add -DDM_TLSF to benchmark the TLSF backend, -DDM_SLAB to serve small
+ *      allocations from slabs, -DDM_DEFERRED_FREE to apply frees in batches.
+ *      -DDM_FIXED_CONTAINERS -DCAPACITY=256 -DCAPACITY_ARRAY=256 runs the
+ *      container benchmarks on the fixed capacity stack and array.
+ *      -DDM_CAPACITY_HINTS sizes the per tick containers of robot_loop from
+ *      their previous peak.
+ *
+ * Usage:
+ *      dm_bench [benchmark]
+ *
+ *      Runs every benchmark, or only those whose name starts with the
+ *      given prefix (e.g. "alloc", "stack", "robot").
+ *
+ * Output is one comma separated line per benchmark so runs can be diffed
+ * or loaded into a spreadsheet to catch regressions:
+ *      benchmark,size,occupancy_pct,ops,ns_per_op,avg_scan,max_scan,failures
+ *
+ *      size            blocks per allocation or elements per container
+ *      occupancy_pct   how full the arena was before the benchmark started,
+ *                      scattered single blocks for alloc_free and one packed
+ *                      chunk at the start of the arena for the containers
+ *      avg_scan        average blocks walked by __find_free_chunk()
+ *      max_scan        longest scan seen
+ *      failures        allocations that returned NULL
+ *
+ * For alloc_worst ns_per_op is the slowest single allocation and free seen,
+ * the bound a real time loop has to budget for.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef MEMORY_SIZE
+#define MEMORY_SIZE 65536
+#endif
+
+#define DM_STATS
+#define DM_QUIET
+#include "dmemory.h"
+
+#define TYPE int
+#include "stack_dm.h"
+#include "array_dm.h"
+#undef TYPE
+
+// Keeps results alive so the compiler can not remove the work.
+static volatile int sink;
+
+static const char* filter = NULL;
+
+unsigned long long now_ns () {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+// Returns YES if the benchmark 'name' was selected on the command line.
+__bool selected (const char* name) {
+    return filter == NULL || strncmp(name, filter, strlen(filter)) == 0;
+}
+
+void report (const char* name, int size, int occupancy, long ops, unsigned long long elapsed) {
+    const dm_stats stats = dm_stats_get();
+    printf("%s,%d,%d,%ld,%.2f,%.2f,%lld,%lu\n",
+            name,
+            size,
+            occupancy,
+            ops,
+            (double)elapsed / ops,
+            stats.allocations == 0 ? 0.0 : (double)stats.scanTotal / stats.allocations,
+            (long long)stats.scanMax,
+            stats.failures);
+    fflush(stdout);
+}
+
+// Fills the arena with single blocks then frees a random selection of them
+// so that 'occupancy' percent of the arena is left in use, scattered.
+void prefill_scattered (int occupancy) {
+    initialize_memory();
+    for (int i = 0; i < MEMORY_SIZE; i++) {
+        dmalloc();
+    }
+    for (int i = 0; i < MEMORY_SIZE; i++) {
+        if (rand() % 100 >= occupancy) {
+            dmfree(&__d_memory[i]);
+        }
+    }
+    dm_stats_reset();
+}
+
+// Allocates the first 'occupancy' percent of the arena as one chunk, like
+// long lived data set up at the start of a program.
+void prefill_packed (int occupancy) {
+    initialize_memory();
+    if (occupancy > 0) {
+        dmalloc_array(MEMORY_SIZE / 100 * occupancy);
+    }
+    dm_stats_reset();
+}
+
+
+//===---- Allocator ----===//
+
+// Allocates and immediately frees a chunk of 'size' blocks in an arena
+// scattered with single blocks.
+void bench_alloc_free (int size, int occupancy) {
+    const long ops = 5000;
+    prefill_scattered(occupancy);
+
+    const unsigned long long start = now_ns();
+    for (long i = 0; i < ops; i++) {
+        block* chunk = dmalloc_array(size);
+        if (chunk != NULL) {
+            dmfree_array(chunk, size);
+        }
+    }
+    report("alloc_free", size, occupancy, ops, now_ns() - start);
+}
+
+// Times every allocation and free of a chunk of 'size' blocks on its own
+// and reports the slowest one.
+void bench_alloc_worst (int size, int occupancy) {
+    const long ops = 5000;
+    prefill_scattered(occupancy);
+
+    unsigned long long worst = 0;
+    for (long i = 0; i < ops; i++) {
+        const unsigned long long start = now_ns();
+        block* chunk = dmalloc_array(size);
+        if (chunk != NULL) {
+            dmfree_array(chunk, size);
+        }
+        const unsigned long long elapsed = now_ns() - start;
+        if (elapsed > worst) {
+            worst = elapsed;
+        }
+    }
+    report("alloc_worst", size, occupancy, 1, worst);
+}
+
+// Fills a quarter of an empty arena with chunks of 'size' blocks, then frees
+// them newest first (LIFO) or in a random order.  Only the frees are timed.
+void bench_free_order (int size, __bool lifo) {
+    const int count = MEMORY_SIZE / size / 4;
+    block** chunks = (block**)malloc(sizeof(block*) * count);
+    const int rounds = 10;
+    unsigned long long elapsed = 0;
+
+    initialize_memory();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < count; i++) {
+            chunks[i] = dmalloc_array(size);
+        }
+
+        if (!lifo) {
+            // Fisher-Yates shuffle.
+            for (int i = count - 1; i > 0; i--) {
+                const int j = rand() % (i + 1);
+                block* temp = chunks[i];
+                chunks[i] = chunks[j];
+                chunks[j] = temp;
+            }
+        }
+
+        dm_stats_reset();
+        const unsigned long long start = now_ns();
+        if (lifo) {
+            for (int i = count - 1; i >= 0; i--) {
+                dmfree_array(chunks[i], size);
+            }
+        } else {
+            for (int i = 0; i < count; i++) {
+                dmfree_array(chunks[i], size);
+            }
+        }
+#ifdef DM_DEFERRED_FREE
+        dm_deferred_flush();
+#endif
+        elapsed += now_ns() - start;
+    }
+
+    report(lifo ? "free_lifo" : "free_random", size, 0, (long)count * rounds, elapsed);
+    free(chunks);
+}
+
+// Fills half of an empty arena with chunks of 'size' blocks, timing the
+// allocations, so the scan grows as the arena fills.
+void bench_alloc_fill (int size) {
+    const int count = MEMORY_SIZE / size / 2;
+    block** chunks = (block**)malloc(sizeof(block*) * count);
+    const int rounds = 2;
+    unsigned long long elapsed = 0;
+
+    initialize_memory();
+    for (int r = 0; r < rounds; r++) {
+        const unsigned long long start = now_ns();
+        for (int i = 0; i < count; i++) {
+            chunks[i] = dmalloc_array(size);
+        }
+        elapsed += now_ns() - start;
+
+        for (int i = 0; i < count; i++) {
+            if (chunks[i] != NULL) {
+                dmfree_array(chunks[i], size);
+            }
+        }
+    }
+
+    report("alloc_fill", size, 0, (long)count * rounds, elapsed);
+    free(chunks);
+}
+
+
+//===---- Containers ----===//
+
+// Pushes 'size' ints onto a stack then pops them all.
+void bench_stack (int size, int occupancy) {
+    const int rounds = 200;
+    prefill_packed(occupancy);
+
+    const unsigned long long start = now_ns();
+    for (int r = 0; r < rounds; r++) {
+        stack_int stack = make_stack_int();
+        for (int i = 0; i < size; i++) {
+            push_int(&stack, i);
+        }
+        int total = 0;
+        while (stack.size > 0) {
+            total += pop_int(&stack);
+        }
+        delete_stack_int(&stack);
+        sink = total;
+    }
+    report("stack_push_pop", size, occupancy, (long)rounds * size * 2, now_ns() - start);
+}
+
+// Appends 'size' ints to an array, removes the first quarter with
+// remove_at and the rest with remove_last.
+void bench_array (int size, int occupancy) {
+    const int rounds = 200;
+    prefill_packed(occupancy);
+
+    const unsigned long long start = now_ns();
+    for (int r = 0; r < rounds; r++) {
+        array_int array = make_array_int();
+        for (int i = 0; i < size; i++) {
+            append_int(&array, i);
+        }
+        int total = 0;
+        for (int i = 0; i < size / 4; i++) {
+            total += remove_at_int(&array, 0);
+        }
+        while (array.size > 0) {
+            total += remove_last_int(&array);
+        }
+        delete_array_int(&array);
+        sink = total;
+    }
+    report("array_append_remove", size, occupancy, (long)rounds * size * 2, now_ns() - start);
+}
+
+
+//===---- Robot Loop ----===//
+
+/*
+ * Mimics the main loop of a robot:
+ *      a long lived map array that slowly grows,
+ *      a path stack rebuilt every tick with a varying number of waypoints,
+ *      a scratch array of sensor readings that lives for a single tick.
+ *
+ * Each op is one tick.
+ */
+void bench_robot_loop (int ticks) {
+    initialize_memory();
+    dm_stats_reset();
+
+    array_int map = make_array_int();
+    int total = 0;
+
+    const unsigned long long start = now_ns();
+    for (int t = 0; t < ticks; t++) {
+        array_int readings = make_array_site_int(0);
+        for (int i = 0; i < 16; i++) {
+            append_int(&readings, rand() % 256);
+        }
+
+        stack_int path = make_stack_site_int(1);
+        const int waypoints = 5 + rand() % 40;
+        for (int i = 0; i < waypoints; i++) {
+            push_int(&path, at_int(&readings, i % 16));
+        }
+        while (path.size > 0) {
+            total += pop_int(&path);
+        }
+
+        if (t % 50 == 0 && map.size < MEMORY_SIZE / 8) {
+            append_int(&map, total);
+        }
+
+        delete_stack_int(&path);
+        delete_array_int(&readings);
+    }
+    const unsigned long long elapsed = now_ns() - start;
+
+    delete_array_int(&map);
+    sink = total;
+    report("robot_loop", 0, 0, ticks, elapsed);
+}
+
+
+int main (int argc, char** argv) {
+    if (argc > 1) {
+        filter = argv[1];
+    }
+    srand(1);
+
+    const int sizes [] = { 1, 4, 16, 64 };
+    const int occupancies [] = { 0, 50, 90 };
+
+    printf("benchmark,size,occupancy_pct,ops,ns_per_op,avg_scan,max_scan,failures\n");
+
+    if (selected("alloc_free")) {
+        for (int o = 0; o < 3; o++) {
+            for (int s = 0; s < 4; s++) {
+                bench_alloc_free(sizes[s], occupancies[o]);
+            }
+        }
+    }
+    if (selected("alloc_worst")) {
+        for (int o = 0; o < 3; o++) {
+            bench_alloc_worst(1, occupancies[o]);
+            bench_alloc_worst(4, occupancies[o]);
+        }
+    }
+    if (selected("alloc_fill")) {
+        for (int s = 0; s < 4; s++) {
+            bench_alloc_fill(sizes[s]);
+        }
+    }
+    if (selected("free_lifo")) {
+        for (int s = 0; s < 4; s++) {
+            bench_free_order(sizes[s], YES);
+        }
+    }
+    if (selected("free_random")) {
+        for (int s = 0; s < 4; s++) {
+            bench_free_order(sizes[s], NO);
+        }
+    }
+    if (selected("stack")) {
+        for (int o = 0; o < 3; o++) {
+            bench_stack(16, occupancies[o]);
+            bench_stack(256, occupancies[o]);
+        }
+    }
+    if (selected("array")) {
+        for (int o = 0; o < 3; o++) {
+            bench_array(16, occupancies[o]);
+            bench_array(256, occupancies[o]);
+        }
+    }
+    if (selected("robot")) {
+        bench_robot_loop(20000);
+    }
+
+    return 0;
+}
@@ -0,0 +1,286 @@
+/*
+ * Comparative benchmark of the d_memory allocator against libc malloc and
+ * the TLSF reference implementation in tlsf.h.
+ *
+ * Every allocator runs the same pregenerated workload: a table of slots
+ * where each operation picks a random slot and either frees what it holds
+ * or fills it with a new allocation of a random size.
+ *
+ * Build:
+ *      gcc -std=gnu99 -O2 -o dm_compare dm_compare.c
+ *
+ *      Add -DDM_TLSF to measure dmalloc_array with the TLSF backend.
+ *
+ * Usage:
+ *      dm_compare [ops] [max size] [slots]
+ *
+ *      ops         number of operations, default 1000000
+ *      max size    allocations are 1 to max size blocks, default 32
+ *      slots       number of slots, about half of them are live, default 2048
+ *
+ * Output is one comma separated line per allocator:
+ *      allocator,ops,ops_per_sec,alloc_p50_ns,alloc_p99_ns,alloc_p999_ns,alloc_max_ns,
+ *      free_p50_ns,free_p99_ns,failures,overhead_bytes_per_alloc
+ *
+ *      ops_per_sec     from a run without per operation timing
+ *      latencies       from a second run timing every operation
+ *      overhead        bookkeeping bytes per allocation, the fixed
+ *                      bookkeeping of the arena allocators is divided by
+ *                      the peak number of live allocations
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef __GLIBC__
+#include <malloc.h> // for malloc_usable_size()
+#endif
+
+#ifndef MEMORY_SIZE
+#define MEMORY_SIZE 65536
+#endif
+
+#define DM_QUIET
+#include "dmemory.h"
+#include "tlsf.h"
+
+// One step of the workload, allocation if size > 0, otherwise a free.
+typedef struct {
+    int slot;
+    int size;
+} operation;
+
+// An allocator under test.
+typedef struct {
+    const char* name;
+    void (*init) ();
+    void* (*alloc) (int blocks);
+    void (*free) (void* p, int blocks);
+    long fixedOverhead;                     // bytes, regardless of use
+    long (*overhead) (void* p, int blocks); // bytes for a single allocation
+} allocator;
+
+unsigned long long now_ns () {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+
+//===---- d_memory ----===//
+
+#ifdef DM_TLSF
+#define ARENA_OVERHEAD ((long)(sizeof(__free_memory) + sizeof(__tlsf_state) \
+            + sizeof(__tlsf_tags) + sizeof(__tlsf_next_free) + sizeof(__tlsf_prev_free)))
+#else
+#define ARENA_OVERHEAD ((long)sizeof(__free_memory))
+#endif
+
+void* arena_alloc (int blocks) {
+    return dmalloc_array(blocks);
+}
+
+void arena_free (void* p, int blocks) {
+    dmfree_array((block*)p, blocks);
+}
+
+long no_overhead (void* p, int blocks) {
+    (void)p;
+    (void)blocks;
+    return 0;
+}
+
+
+//===---- malloc ----===//
+
+void malloc_init () {
+}
+
+void* malloc_alloc (int blocks) {
+    return malloc(blocks * sizeof(block));
+}
+
+void malloc_free (void* p, int blocks) {
+    (void)blocks;
+    free(p);
+}
+
+// Chunk header plus the rounding up done by malloc.
+long malloc_overhead (void* p, int blocks) {
+#ifdef __GLIBC__
+    return (long)(malloc_usable_size(p) - blocks * sizeof(block) + sizeof(size_t));
+#else
+    return (long)sizeof(size_t);
+#endif
+}
+
+
+//===---- TLSF ----===//
+
+static block tlsfPool [MEMORY_SIZE];
+static unsigned char tlsfUsed [(MEMORY_SIZE + 7) / 8];
+static int tlsfTag [MEMORY_SIZE];
+static int tlsfNext [MEMORY_SIZE];
+static int tlsfPrev [MEMORY_SIZE];
+static tlsf tlsfControl;
+
+void tlsf_bench_init () {
+    tlsf_init(&tlsfControl, MEMORY_SIZE, tlsfUsed, tlsfTag, tlsfNext, tlsfPrev);
+}
+
+void* tlsf_bench_alloc (int blocks) {
+    const int index = tlsf_alloc(&tlsfControl, blocks);
+    return index == TLSF_NONE ? NULL : &tlsfPool[index];
+}
+
+void tlsf_bench_free (void* p, int blocks) {
+    tlsf_free(&tlsfControl, (int)((block*)p - tlsfPool), blocks);
+}
+
+
+//===---- Benchmark ----===//
+
+typedef struct {
+    unsigned long long elapsed;
+    int failures;
+    int peakLive;
+    long overhead;  // sum of per allocation overhead
+    int allocations;
+} run_result;
+
+int compare_ull (const void* a, const void* b) {
+    const unsigned long long x = *(const unsigned long long*)a;
+    const unsigned long long y = *(const unsigned long long*)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+unsigned long long percentile (unsigned long long* sorted, int count, double p) {
+    if (count == 0) {
+        return 0;
+    }
+    int i = (int)(p / 100.0 * count);
+    return sorted[i < count ? i : count - 1];
+}
+
+// Runs the workload once.  If 'allocLatency' and 'freeLatency' are given
+// every operation is timed and its latency stored in them.
+run_result run (const allocator* a, const operation* ops, int count, int slotCount,
+        unsigned long long* allocLatency, int* allocCount,
+        unsigned long long* freeLatency, int* freeCount) {
+    void** slots = (void**)calloc(slotCount, sizeof(void*));
+    int* sizes = (int*)calloc(slotCount, sizeof(int));
+    run_result result = { 0, 0, 0, 0, 0 };
+    int live = 0;
+
+    a->init();
+    const __bool timed = allocLatency != NULL;
+    const unsigned long long start = now_ns();
+    for (int i = 0; i < count; i++) {
+        const operation op = ops[i];
+        if (op.size > 0) {
+            const unsigned long long t = timed ? now_ns() : 0;
+            void* p = a->alloc(op.size);
+            if (timed) {
+                allocLatency[(*allocCount)++] = now_ns() - t;
+            }
+            if (p == NULL) {
+                ++result.failures;
+                continue;
+            }
+            slots[op.slot] = p;
+            sizes[op.slot] = op.size;
+            ++result.allocations;
+            if (++live > result.peakLive) {
+                result.peakLive = live;
+            }
+            if (!timed) {
+                result.overhead += a->overhead(p, op.size);
+            }
+        } else if (slots[op.slot] != NULL) {
+            const unsigned long long t = timed ? now_ns() : 0;
+            a->free(slots[op.slot], sizes[op.slot]);
+            if (timed) {
+                freeLatency[(*freeCount)++] = now_ns() - t;
+            }
+            slots[op.slot] = NULL;
+            --live;
+        }
+    }
+    result.elapsed = now_ns() - start;
+
+    // Clean up so malloc starts the next run empty as well.
+    for (int i = 0; i < slotCount; i++) {
+        if (slots[i] != NULL) {
+            a->free(slots[i], sizes[i]);
+        }
+    }
+    free(slots);
+    free(sizes);
+    return result;
+}
+
+int main (int argc, char** argv) {
+    const int count = argc > 1 ? atoi(argv[1]) : 1000000;
+    const int maxSize = argc > 2 ? atoi(argv[2]) : 32;
+    const int slotCount = argc > 3 ? atoi(argv[3]) : 2048;
+
+    const allocator allocators [] = {
+        { "dmalloc", initialize_memory, arena_alloc, arena_free,
+            ARENA_OVERHEAD, no_overhead },
+        { "malloc", malloc_init, malloc_alloc, malloc_free,
+            0, malloc_overhead },
+        { "tlsf", tlsf_bench_init, tlsf_bench_alloc, tlsf_bench_free,
+            tlsf_overhead(MEMORY_SIZE), no_overhead },
+    };
+    const int allocatorCount = (int)(sizeof(allocators) / sizeof(allocators[0]));
+
+    // Generate the workload up front so every allocator sees the same one.
+    operation* ops = (operation*)malloc(sizeof(operation) * count);
+    char* occupied = (char*)calloc(slotCount, 1);
+    srand(1);
+    for (int i = 0; i < count; i++) {
+        ops[i].slot = rand() % slotCount;
+        ops[i].size = occupied[ops[i].slot] ? 0 : 1 + rand() % maxSize;
+        occupied[ops[i].slot] = !occupied[ops[i].slot];
+    }
+    free(occupied);
+
+    unsigned long long* allocLatency = (unsigned long long*)malloc(sizeof(unsigned long long) * count);
+    unsigned long long* freeLatency = (unsigned long long*)malloc(sizeof(unsigned long long) * count);
+
+    printf("allocator,ops,ops_per_sec,alloc_p50_ns,alloc_p99_ns,alloc_p999_ns,alloc_max_ns,"
+            "free_p50_ns,free_p99_ns,failures,overhead_bytes_per_alloc\n");
+    for (int i = 0; i < allocatorCount; i++) {
+        const allocator* a = &allocators[i];
+        const run_result r = run(a, ops, count, slotCount, NULL, NULL, NULL, NULL);
+
+        int allocCount = 0;
+        int freeCount = 0;
+        run(a, ops, count, slotCount, allocLatency, &allocCount, freeLatency, &freeCount);
+        qsort(allocLatency, allocCount, sizeof(unsigned long long), compare_ull);
+        qsort(freeLatency, freeCount, sizeof(unsigned long long), compare_ull);
+
+        const double overhead = (r.peakLive == 0 ? 0.0 : (double)a->fixedOverhead / r.peakLive)
+            + (r.allocations == 0 ? 0.0 : (double)r.overhead / r.allocations);
+
+        printf("%s,%d,%.0f,%llu,%llu,%llu,%llu,%llu,%llu,%d,%.2f\n",
+                a->name,
+                count,
+                count / (r.elapsed / 1e9),
+                percentile(allocLatency, allocCount, 50.0),
+                percentile(allocLatency, allocCount, 99.0),
+                percentile(allocLatency, allocCount, 99.9),
+                allocCount == 0 ? 0ULL : allocLatency[allocCount - 1],
+                percentile(freeLatency, freeCount, 50.0),
+                percentile(freeLatency, freeCount, 99.0),
+                r.failures,
+                overhead);
+        fflush(stdout);
+    }
+
+    free(ops);
+    free(allocLatency);
+    free(freeLatency);
+    return 0;
+}
@@ -0,0 +1,163 @@
+/*
+ * Reference test of the 64 bit dm_index paths.
+ *
+ * Runs __first_fit_range(), __last_fit_range() and the deferred free radix
+ * sort on blocks around 2^31 and 2^32, and at the very end of an arena of
+ * a little over 2^32 blocks, and checks the indices they return and the
+ * bits they leave in __free_memory.
+ *
+ * The arena is sparse: __d_memory is a MAP_NORESERVE mapping, which the
+ * tested functions never touch, and only the words of __free_memory and
+ * __free_summary around the tested indices are set up, so the test runs in
+ * a few megabytes.  initialize_memory() is not called, it would write every
+ * block.
+ *
+ * Build:
+ *      gcc -std=gnu99 -O2 -DDM_LARGE_ARENA -DDM_DEFERRED_FREE -o dm_large_test dm_large_test.c
+ *
+ * Prints one line per check and exits with 1 if any of them failed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#ifndef DM_LARGE_ARENA
+#error "build dm_large_test with -DDM_LARGE_ARENA"
+#endif
+#ifndef DM_DEFERRED_FREE
+#error "build dm_large_test with -DDM_DEFERRED_FREE"
+#endif
+
+// Not a multiple of 64, so the last word is partly past the end.
+#define MEMORY_SIZE ((1LL << 32) + (1LL << 20) + 1000)
+
+// Turns the static __d_memory array into a pointer to one, set up in main().
+#define __d_memory (*__large_memory)
+
+#define DM_QUIET
+#include "dmemory.h"
+
+// Words set up around each tested index.
+#define WINDOW_WORDS 64
+
+static int failures = 0;
+
+void check (const char* what, long long got, long long expected) {
+    const int ok = got == expected;
+    printf("%-40s %s (got %lld, expected %lld)\n", what, ok ? "ok" : "FAILED", got, expected);
+    if (!ok) {
+        ++failures;
+    }
+}
+
+// Summarizes the words [firstWord, endWord), every block in them is free.
+void open_window (dm_index firstWord, dm_index endWord) {
+    for (dm_index w = firstWord; w < endWord; w++) {
+        __summarize_word(w);
+    }
+}
+
+// Returns the number of blocks in [idx, idx + n) that are in use.
+long long used_blocks (dm_index idx, dm_index n) {
+    long long used = 0;
+    for (dm_index i = idx; i < idx + n; i++) {
+        used += !__check_block_free(i);
+    }
+    return used;
+}
+
+// First and last fit inside a window of words starting at block 'base'.
+void test_fit (const char* name, dm_index base) {
+    char what [64];
+    const dm_index firstWord = base / 64;
+    const dm_index endWord = firstWord + WINDOW_WORDS;
+    open_window(firstWord, endWord);
+
+    // A used prefix that ends inside the second word, so the first fit
+    // starts there and its run straddles into the third.
+    __set_blocks(base, 100, YES);
+    snprintf(what, sizeof(what), "%s first fit", name);
+    check(what, __first_fit_range(50, firstWord, endWord), base + 100);
+    snprintf(what, sizeof(what), "%s first fit bits", name);
+    check(what, used_blocks(base, 200), 150);
+
+    // A run longer than a word, carried through whole free words.
+    snprintf(what, sizeof(what), "%s first fit across words", name);
+    check(what, __first_fit_range(300, firstWord, endWord), base + 150);
+
+    snprintf(what, sizeof(what), "%s last fit", name);
+    check(what, __last_fit_range(30, firstWord, endWord), endWord * 64 - 30);
+    snprintf(what, sizeof(what), "%s last fit across words", name);
+    check(what, __last_fit_range(130, firstWord, endWord), endWord * 64 - 160);
+
+    // A hole freed in the used prefix is found before the rest of the window.
+    __set_blocks(base + 10, 20, NO);
+    snprintf(what, sizeof(what), "%s first fit in hole", name);
+    check(what, __first_fit_range(20, firstWord, endWord), base + 10);
+}
+
+// Last fit at the end of the arena, whose last word is partly past it.
+void test_end () {
+    const dm_index endWord = (MEMORY_SIZE + 63) / 64;
+    const dm_index firstWord = endWord - WINDOW_WORDS;
+    open_window(firstWord, endWord);
+
+    check("end last fit", __last_fit_range(10, firstWord, endWord), MEMORY_SIZE - 10);
+    check("end first fit too large", __first_fit_range(WINDOW_WORDS * 64, firstWord, endWord), -1);
+}
+
+// Queues frees around 2^31 and 2^32 out of order, sorts and flushes them.
+void test_deferred_sort () {
+    const dm_index bases [] = { (1LL << 32) + 8192, (1LL << 31) - 256, (1LL << 32) + 65536, (1LL << 31) + 8192 };
+    const int count = sizeof(bases) / sizeof(bases[0]);
+
+    // Each base gets four runs of 8 blocks, queued last run first, so the
+    // sort has to order them and the flush merges each base into one run.
+    for (int i = 0; i < count; i++) {
+        open_window(bases[i] / 64, bases[i] / 64 + 1);
+        __set_blocks(bases[i], 32, YES);
+    }
+    __deferred_count = 0;
+    for (int run = 3; run >= 0; run--) {
+        for (int i = 0; i < count; i++) {
+            __deferred_frees[__deferred_count].index = bases[i] + 8 * run;
+            __deferred_frees[__deferred_count].size = 8;
+            ++__deferred_count;
+        }
+    }
+
+    __deferred_sort();
+    int sorted = 1;
+    for (int i = 1; i < __deferred_count; i++) {
+        sorted &= __deferred_frees[i - 1].index < __deferred_frees[i].index;
+    }
+    check("deferred sort order", sorted, 1);
+    check("deferred sort first", __deferred_frees[0].index, (1LL << 31) - 256);
+    check("deferred sort last", __deferred_frees[__deferred_count - 1].index, (1LL << 32) + 65536 + 24);
+
+    dm_deferred_flush();
+    long long used = 0;
+    for (int i = 0; i < count; i++) {
+        used += used_blocks(bases[i], 32);
+    }
+    check("deferred flush bits", used, 0);
+    check("deferred flush queue", __deferred_count, 0);
+}
+
+int main () {
+    __large_memory = mmap(NULL, sizeof(*__large_memory), PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (__large_memory == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    test_fit("2^31", (1LL << 31) - 64);
+    test_fit("2^32", (1LL << 32) - 64);
+    test_end();
+    test_deferred_sort();
+
+    printf("%s\n", failures == 0 ? "all passed" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}
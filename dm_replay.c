@@ -0,0 +1,259 @@
+/*
+ * Allocation event replay tool.
+ *
+ * Re-executes an event log written by dm_event_flush() (see 'Event Log' in
+ * dmemory.h) against an allocator backend and reports, at a fixed event
+ * interval, how full and how fragmented the arena is along with the scan
+ * lengths and failures seen so far.
+ *
+ * Build:
+ *      gcc -std=gnu99 -O2 -o dm_replay dm_replay.c
+ *
+ * Usage:
+ *      dm_replay <event log> [interval] [backend]
+ *
+ *      interval    number of events between report lines, default 1000
+ *      backend     allocator to replay against, default "arena":
+ *                  arena   the bitmap allocator from dmemory.h, built with
+ *                          whatever DM_ options dm_replay was built with
+ *                  tlsf    the TLSF reference implementation in tlsf.h,
+ *                          whose scan length is always 0
+ *
+ * Output is one comma separated line per interval:
+ *      events,used_blocks,used_pct,fragmentation_pct,avg_scan,max_scan,failures,rescued
+ *
+ *      fragmentation_pct   100 * (1 - largest free run / free blocks)
+ *      failures            allocations that failed in the replay
+ *      rescued             allocations that failed when recorded but
+ *                          succeeded in the replay
+ *
+ * The replay arena size is set with MEMORY_SIZE at compile time and should be
+ * at least the size the log was recorded with.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef MEMORY_SIZE
+#define MEMORY_SIZE 65536
+#endif
+
+#define DM_QUIET
+#include "dmemory.h"
+#include "tlsf.h"
+
+// An allocator the events can be replayed against.
+//
+// Indices are in blocks from the start of the backend's arena,
+// alloc returns -1 on failure.
+typedef struct {
+    const char* name;
+    void (*init) ();
+    int (*alloc) (int size);
+    void (*free) (int index, int size);
+    int (*scan_length) ();
+    __bool (*is_free) (int index);
+    int capacity;
+} replay_backend;
+
+
+//===---- Arena Backend ----===//
+// The first fit bitmap allocator from dmemory.h.
+
+int __arena_alloc (int size) {
+    block* chunk = dmalloc_array(size);
+    return chunk == NULL ? -1 : (int)(chunk - __d_memory);
+}
+
+void __arena_free (int index, int size) {
+    dmfree_array(&__d_memory[index], size);
+}
+
+int __arena_scan_length () {
+    return __last_scan_length;
+}
+
+
+//===---- TLSF Backend ----===//
+// The two level segregated fit allocator from tlsf.h on its own arena, only
+// the indices matter so there is no pool behind it.
+
+static unsigned char tlsfUsed [(MEMORY_SIZE + 7) / 8];
+static int tlsfTag [MEMORY_SIZE];
+static int tlsfNext [MEMORY_SIZE];
+static int tlsfPrev [MEMORY_SIZE];
+static tlsf tlsfControl;
+
+void __tlsf_replay_init () {
+    tlsf_init(&tlsfControl, MEMORY_SIZE, tlsfUsed, tlsfTag, tlsfNext, tlsfPrev);
+}
+
+int __tlsf_replay_alloc (int size) {
+    const int index = tlsf_alloc(&tlsfControl, size);
+    return index == TLSF_NONE ? -1 : index;
+}
+
+void __tlsf_replay_free (int index, int size) {
+    tlsf_free(&tlsfControl, index, size);
+}
+
+// Allocations and frees take bounded time, nothing is scanned.
+int __tlsf_replay_scan_length () {
+    return 0;
+}
+
+__bool __tlsf_replay_is_free (int index) {
+    return __tlsf_is_used(&tlsfControl, index) ? NO : YES;
+}
+
+static const replay_backend backends [] = {
+    { "arena", initialize_memory, __arena_alloc, __arena_free, __arena_scan_length, __check_block_free, MEMORY_SIZE },
+    { "tlsf", __tlsf_replay_init, __tlsf_replay_alloc, __tlsf_replay_free, __tlsf_replay_scan_length, __tlsf_replay_is_free, MEMORY_SIZE },
+};
+
+#define BACKEND_COUNT ((int)(sizeof(backends) / sizeof(backends[0])))
+
+
+//===---- Replay ----===//
+
+typedef struct {
+    unsigned long events;
+    long scanTotal;
+    int scanMax;
+    int allocations;
+    int failures;
+    int rescued;
+} replay_stats;
+
+// Prints a single report line for the current state of the backend.
+void report (const replay_backend* backend, replay_stats* stats) {
+    int used = 0;
+    int largestRun = 0;
+    int run = 0;
+    for (int i = 0; i < backend->capacity; i++) {
+        if (backend->is_free(i)) {
+            ++run;
+            if (run > largestRun) {
+                largestRun = run;
+            }
+        } else {
+            ++used;
+            run = 0;
+        }
+    }
+
+    const int freeBlocks = backend->capacity - used;
+    const double fragmentation = freeBlocks == 0 ? 0.0 : 100.0 * (1.0 - (double)largestRun / freeBlocks);
+    const double avgScan = stats->allocations == 0 ? 0.0 : (double)stats->scanTotal / stats->allocations;
+
+    printf("%lu,%d,%.2f,%.2f,%.2f,%d,%d,%d\n",
+            stats->events,
+            used,
+            100.0 * used / backend->capacity,
+            fragmentation,
+            avgScan,
+            stats->scanMax,
+            stats->failures,
+            stats->rescued);
+}
+
+int main (int argc, char** argv) {
+    if (argc < 2) {
+        printf("usage: %s <event log> [interval] [backend]\n", argv[0]);
+        return 1;
+    }
+
+    const long interval = argc > 2 ? atol(argv[2]) : 1000;
+    const char* backendName = argc > 3 ? argv[3] : "arena";
+
+    const replay_backend* backend = NULL;
+    for (int i = 0; i < BACKEND_COUNT; i++) {
+        if (strcmp(backends[i].name, backendName) == 0) {
+            backend = &backends[i];
+        }
+    }
+    if (backend == NULL) {
+        printf("unknown backend: %s\n", backendName);
+        return 1;
+    }
+
+    FILE* file = fopen(argv[1], "rb");
+    if (file == NULL) {
+        printf("unable to open %s\n", argv[1]);
+        return 1;
+    }
+
+    dm_event_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1
+            || header.magic != DM_EVENT_MAGIC
+            || header.version != DM_EVENT_VERSION) {
+        printf("%s is not an event log\n", argv[1]);
+        fclose(file);
+        return 1;
+    }
+    if ((int)header.memorySize > backend->capacity) {
+        printf("warning: log recorded with %u blocks, replaying with %d\n",
+                header.memorySize, backend->capacity);
+    }
+
+    // Maps every block of the recorded arena to its block in the replay,
+    // -1 if the allocation that owns it failed in the replay.
+    int* map = (int*)malloc(sizeof(int) * header.memorySize);
+    for (unsigned int i = 0; i < header.memorySize; i++) {
+        map[i] = -1;
+    }
+
+    backend->init();
+
+    replay_stats stats = { 0, 0, 0, 0, 0, 0 };
+    printf("events,used_blocks,used_pct,fragmentation_pct,avg_scan,max_scan,failures,rescued\n");
+
+    dm_event event;
+    while (fread(&event, sizeof(event), 1, file) == 1) {
+        if (event.op == DM_EVENT_ALLOC || event.op == DM_EVENT_FAIL) {
+            const int index = backend->alloc((int)event.size);
+            const int scan = backend->scan_length();
+            stats.scanTotal += scan;
+            if (scan > stats.scanMax) {
+                stats.scanMax = scan;
+            }
+            ++stats.allocations;
+
+            if (event.op == DM_EVENT_FAIL) {
+                // The recording program never got this memory so it will
+                // never free it, give it straight back.
+                if (index >= 0) {
+                    ++stats.rescued;
+                    backend->free(index, (int)event.size);
+                }
+            } else if (index < 0) {
+                ++stats.failures;
+            } else {
+                for (unsigned int i = 0; i < event.size && event.index + i < header.memorySize; i++) {
+                    map[event.index + i] = index + (int)i;
+                }
+            }
+        } else if (event.op == DM_EVENT_FREE && event.index < header.memorySize) {
+            if (map[event.index] >= 0) {
+                backend->free(map[event.index], (int)event.size);
+            }
+            for (unsigned int i = 0; i < event.size && event.index + i < header.memorySize; i++) {
+                map[event.index + i] = -1;
+            }
+        }
+
+        ++stats.events;
+        if (interval > 0 && stats.events % interval == 0) {
+            report(backend, &stats);
+        }
+    }
+
+    if (interval <= 0 || stats.events % interval != 0) {
+        report(backend, &stats);
+    }
+
+    free(map);
+    fclose(file);
+    return 0;
+}
@@ -0,0 +1,164 @@
+/*
+ * Multithreaded scaling benchmark of the d_memory allocator.
+ *
+ * Every thread runs the same kind of workload as dm_compare.c on its own
+ * table of slots: each operation picks a random slot and either frees what
+ * it holds or fills it with a new allocation of a random size.  The run is
+ * repeated with 1, 2, 4 and so on up to 64 threads, all started together.
+ *
+ * Build:
+ *      gcc -std=gnu99 -O2 -DDM_THREADS -o dm_scale dm_scale.c -lpthread
+ *
+ *      Add -DDM_SHARDS=16 (or any other count) to split the bitmap into
+ *      shards, see 'Shards' in dmemory.h.  Without it every allocation and
+ *      free that misses the thread caches takes the one arena lock.
+ *
+ * Usage:
+ *      dm_scale [ops] [max size] [slots]
+ *
+ *      ops         operations per thread, default 200000
+ *      max size    allocations are 1 to max size blocks, default 32
+ *      slots       slots per thread, about half of them are live, default 256
+ *
+ * Output is one comma separated line per thread count:
+ *      config,threads,ops,ops_per_sec,speedup,failures
+ *
+ *      config      "lock" or "shards=N"
+ *      ops         operations of all threads together
+ *      speedup     ops_per_sec relative to the single thread run
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifndef MEMORY_SIZE
+#define MEMORY_SIZE (1 << 20)
+#endif
+
+#define DM_QUIET
+#include "dmemory.h"
+
+#ifndef DM_THREADS
+#error "build dm_scale with -DDM_THREADS"
+#endif
+
+#define MAX_THREADS 64
+
+typedef struct {
+    pthread_t thread;
+    unsigned int seed;
+    long failures;
+} worker;
+
+static long opsPerThread;
+static int maxSize;
+static int slotCount;
+static pthread_barrier_t startLine;
+
+unsigned long long now_ns () {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+// Per thread xorshift, rand() takes a lock in glibc.
+unsigned int next_random (unsigned int* state) {
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+void* run_worker (void* arg) {
+    worker* w = (worker*)arg;
+    block** slots = (block**)calloc(slotCount, sizeof(block*));
+    int* sizes = (int*)calloc(slotCount, sizeof(int));
+
+    pthread_barrier_wait(&startLine);
+    for (long i = 0; i < opsPerThread; i++) {
+        const int slot = (int)(next_random(&w->seed) % slotCount);
+        if (slots[slot] != NULL) {
+            dmfree_array(slots[slot], sizes[slot]);
+            slots[slot] = NULL;
+        } else {
+            sizes[slot] = 1 + (int)(next_random(&w->seed) % maxSize);
+            slots[slot] = dmalloc_array(sizes[slot]);
+            if (slots[slot] == NULL) {
+                ++w->failures;
+            }
+        }
+    }
+    pthread_barrier_wait(&startLine);
+
+    for (int i = 0; i < slotCount; i++) {
+        if (slots[i] != NULL) {
+            dmfree_array(slots[i], sizes[i]);
+        }
+    }
+    dm_thread_exit();
+    free(slots);
+    free(sizes);
+    return NULL;
+}
+
+// Runs the workload on 'threads' threads, returns operations per second.
+double run (int threads, long* failures) {
+    worker workers [MAX_THREADS];
+    initialize_memory();
+    pthread_barrier_init(&startLine, NULL, threads + 1);
+
+    for (int i = 0; i < threads; i++) {
+        workers[i].seed = 2463534242u + 7919u * (unsigned int)i;
+        workers[i].failures = 0;
+        pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+    }
+    // Timed from when every thread is ready until every thread is done,
+    // the final frees are not counted.
+    pthread_barrier_wait(&startLine);
+    const unsigned long long start = now_ns();
+    pthread_barrier_wait(&startLine);
+    const unsigned long long elapsed = now_ns() - start;
+
+    *failures = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        *failures += workers[i].failures;
+    }
+    pthread_barrier_destroy(&startLine);
+    return (double)opsPerThread * threads / (elapsed / 1e9);
+}
+
+int main (int argc, char** argv) {
+    opsPerThread = argc > 1 ? atol(argv[1]) : 200000;
+    maxSize = argc > 2 ? atoi(argv[2]) : 32;
+    slotCount = argc > 3 ? atoi(argv[3]) : 256;
+
+    char config [32];
+#ifdef DM_SHARDS
+    snprintf(config, sizeof(config), "shards=%d", DM_SHARDS);
+#else
+    snprintf(config, sizeof(config), "lock");
+#endif
+
+    printf("config,threads,ops,ops_per_sec,speedup,failures\n");
+    double single = 0.0;
+    for (int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        long failures;
+        const double opsPerSec = run(threads, &failures);
+        if (threads == 1) {
+            single = opsPerSec;
+        }
+        printf("%s,%d,%ld,%.0f,%.2f,%ld\n",
+                config,
+                threads,
+                opsPerThread * threads,
+                opsPerSec,
+                opsPerSec / single,
+                failures);
+        fflush(stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,372 @@
+/*
+ * Synthetic workload generator and fragmentation stress benchmark.
+ *
+ * Drives the __d_memory arena with a stream of allocations whose sizes and
+ * lifetimes are drawn from configurable distributions, for as many
+ * operations as needed to reach a steady state, and reports how full and
+ * how fragmented the arena gets over time.
+ *
+ * Build:
+ *      gcc -std=gnu99 -O2 -o dm_workload dm_workload.c -lm
+ *
+ *      Add -DDM_EVENT_LOG to be able to save the workload with -o and
+ *      replay it against other backends with dm_replay.
+ *
+ * Usage:
+ *      dm_workload [options]
+ *
+ *      -n ops          number of operations, default 1000000
+ *      -i interval     operations between report lines, default ops / 20
+ *      -r seed         random seed, default 1
+ *
+ *      -s dist         size distribution in blocks, default uniform
+ *                          fixed        always -m
+ *                          uniform      1 to -m
+ *                          exponential  mean -m
+ *                          bimodal      -m with 90% chance, -M otherwise
+ *      -m size         default 16
+ *      -M size         default 256
+ *
+ *      -l dist         lifetime distribution, default exponential
+ *                          exponential  mean -L operations
+ *                          bimodal      mean -L with 90% chance, 20 * -L otherwise
+ *                          lifo         up to -L objects live, newest freed first
+ *                          fifo         up to -L objects live, oldest freed first
+ *      -L lifetime     default 1000
+ *      -H threshold    allocate objects that will live longer than threshold
+ *                      operations with DM_LONG_LIVED, exponential and bimodal
+ *                      only, default 0 (no hints)
+ *
+ *      -o file         save the workload as an event log (needs DM_EVENT_LOG)
+ *
+ * Output is one comma separated line per interval:
+ *      ops,live_objects,used_blocks,peak_blocks,used_pct,fragmentation_pct,failure_pct
+ *
+ *      fragmentation_pct   100 * (1 - largest free run / free blocks)
+ *      failure_pct         failed allocations over allocations this interval
+ *
+ * followed by a summary line:
+ *      total,allocations,peak_blocks,peak_pct,failure_pct
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef MEMORY_SIZE
+#define MEMORY_SIZE 65536
+#endif
+
+#define DM_QUIET
+#include "dmemory.h"
+
+#define DIST_FIXED          0
+#define DIST_UNIFORM        1
+#define DIST_EXPONENTIAL    2
+#define DIST_BIMODAL        3
+#define DIST_LIFO           4
+#define DIST_FIFO           5
+
+// A live allocation.
+typedef struct {
+    block* start;
+    int size;
+    long death;     // operation at which it is freed, exponential and bimodal only
+} object;
+
+typedef struct {
+    long ops;
+    long interval;
+    unsigned int seed;
+    int sizeDist;
+    int sizeSmall;
+    int sizeLarge;
+    int lifetimeDist;
+    int lifetime;
+    long hintThreshold;
+    const char* logPath;
+} workload;
+
+// Live objects, used as a heap ordered by death for the exponential and
+// bimodal lifetimes, as a stack for lifo and as a ring queue for fifo.
+static object* objects;
+static int objectCount = 0;
+static int objectCapacity = 0;
+static int queueHead = 0;
+
+
+//===---- Distributions ----===//
+
+// Returns a uniformly distributed double in [0, 1).
+double uniform () {
+    return rand() / ((double)RAND_MAX + 1.0);
+}
+
+// Returns an exponentially distributed value with the given mean.
+double exponential (double mean) {
+    return -mean * log(1.0 - uniform());
+}
+
+int sample_size (const workload* w) {
+    int size = 1;
+    switch (w->sizeDist) {
+        case DIST_FIXED:        size = w->sizeSmall; break;
+        case DIST_UNIFORM:      size = 1 + rand() % w->sizeSmall; break;
+        case DIST_EXPONENTIAL:  size = 1 + (int)exponential(w->sizeSmall - 1); break;
+        case DIST_BIMODAL:      size = uniform() < 0.9 ? w->sizeSmall : w->sizeLarge; break;
+    }
+    return size < 1 ? 1 : size;
+}
+
+long sample_lifetime (const workload* w) {
+    if (w->lifetimeDist == DIST_BIMODAL && uniform() >= 0.9) {
+        return 1 + (long)exponential(20.0 * w->lifetime);
+    }
+    return 1 + (long)exponential(w->lifetime);
+}
+
+int parse_dist (const char* name) {
+    if (strcmp(name, "fixed") == 0)         return DIST_FIXED;
+    if (strcmp(name, "uniform") == 0)       return DIST_UNIFORM;
+    if (strcmp(name, "exponential") == 0)   return DIST_EXPONENTIAL;
+    if (strcmp(name, "bimodal") == 0)       return DIST_BIMODAL;
+    if (strcmp(name, "lifo") == 0)          return DIST_LIFO;
+    if (strcmp(name, "fifo") == 0)          return DIST_FIFO;
+    return -1;
+}
+
+
+//===---- Death Heap ----===//
+
+void heap_swap (int a, int b) {
+    object temp = objects[a];
+    objects[a] = objects[b];
+    objects[b] = temp;
+}
+
+void heap_push (object o) {
+    int i = objectCount++;
+    objects[i] = o;
+    while (i > 0 && objects[(i - 1) / 2].death > objects[i].death) {
+        heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+object heap_pop () {
+    object top = objects[0];
+    objects[0] = objects[--objectCount];
+    int i = 0;
+    while (YES) {
+        const int l = 2 * i + 1;
+        const int r = l + 1;
+        int smallest = i;
+        if (l < objectCount && objects[l].death < objects[smallest].death) {
+            smallest = l;
+        }
+        if (r < objectCount && objects[r].death < objects[smallest].death) {
+            smallest = r;
+        }
+        if (smallest == i) {
+            break;
+        }
+        heap_swap(i, smallest);
+        i = smallest;
+    }
+    return top;
+}
+
+
+//===---- Workload ----===//
+
+typedef struct {
+    long allocations;
+    long failures;
+    int usedBlocks;
+    int peakBlocks;
+} counters;
+
+void release (object o, counters* c) {
+    dmfree_array(o.start, o.size);
+    c->usedBlocks -= o.size;
+}
+
+// Tries to allocate a new object, returns NO if d_memory is exhausted.
+__bool allocate (const workload* w, long op, object* o, counters* c) {
+    o->size = sample_size(w);
+    const long lifetime = sample_lifetime(w);
+    const __bool ordered = w->lifetimeDist == DIST_LIFO || w->lifetimeDist == DIST_FIFO;
+    const __bool longLived = !ordered && w->hintThreshold > 0 && lifetime > w->hintThreshold;
+    o->start = dmalloc_hint(o->size, longLived ? DM_LONG_LIVED : DM_SHORT_LIVED);
+    ++c->allocations;
+    if (o->start == NULL) {
+        ++c->failures;
+        return NO;
+    }
+
+    o->death = op + lifetime;
+    c->usedBlocks += o->size;
+    if (c->usedBlocks > c->peakBlocks) {
+        c->peakBlocks = c->usedBlocks;
+    }
+    return YES;
+}
+
+// Performs a single operation of a lifo or fifo workload: frees an object
+// at random or once -L are live, otherwise allocates one.
+void step_ordered (const workload* w, long op, counters* c) {
+    if (objectCount < w->lifetime && objectCount < objectCapacity
+            && (objectCount == 0 || uniform() < 0.5)) {
+        object o;
+        if (allocate(w, op, &o, c)) {
+            objects[(queueHead + objectCount) % objectCapacity] = o;
+            ++objectCount;
+        }
+    } else if (objectCount > 0) {
+        if (w->lifetimeDist == DIST_LIFO) {
+            release(objects[(queueHead + objectCount - 1) % objectCapacity], c);
+        } else {
+            release(objects[queueHead], c);
+            queueHead = (queueHead + 1) % objectCapacity;
+        }
+        --objectCount;
+    }
+}
+
+// Performs a single operation of an exponential or bimodal workload: frees
+// every object whose lifetime has run out, then allocates one.
+void step_timed (const workload* w, long op, counters* c) {
+    while (objectCount > 0 && objects[0].death <= op) {
+        release(heap_pop(), c);
+    }
+    object o;
+    if (objectCount < objectCapacity && allocate(w, op, &o, c)) {
+        heap_push(o);
+    }
+}
+
+void report (long op, const counters* c, const counters* last) {
+    int largestRun = 0;
+    int run = 0;
+    int freeBlocks = 0;
+    for (int i = 0; i < MEMORY_SIZE; i++) {
+        if (__check_block_free(i)) {
+            ++freeBlocks;
+            ++run;
+            if (run > largestRun) {
+                largestRun = run;
+            }
+        } else {
+            run = 0;
+        }
+    }
+
+    const long allocations = c->allocations - last->allocations;
+    const long failures = c->failures - last->failures;
+    printf("%ld,%d,%d,%d,%.2f,%.2f,%.3f\n",
+            op,
+            objectCount,
+            c->usedBlocks,
+            c->peakBlocks,
+            100.0 * c->usedBlocks / MEMORY_SIZE,
+            freeBlocks == 0 ? 0.0 : 100.0 * (1.0 - (double)largestRun / freeBlocks),
+            allocations == 0 ? 0.0 : 100.0 * failures / allocations);
+    fflush(stdout);
+}
+
+int main (int argc, char** argv) {
+    workload w;
+    w.ops = 1000000;
+    w.interval = 0;
+    w.seed = 1;
+    w.sizeDist = DIST_UNIFORM;
+    w.sizeSmall = 16;
+    w.sizeLarge = 256;
+    w.lifetimeDist = DIST_EXPONENTIAL;
+    w.lifetime = 1000;
+    w.hintThreshold = 0;
+    w.logPath = NULL;
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const char* value = argv[i + 1];
+        if (strcmp(argv[i], "-n") == 0)         w.ops = atol(value);
+        else if (strcmp(argv[i], "-i") == 0)    w.interval = atol(value);
+        else if (strcmp(argv[i], "-r") == 0)    w.seed = (unsigned int)atoi(value);
+        else if (strcmp(argv[i], "-s") == 0)    w.sizeDist = parse_dist(value);
+        else if (strcmp(argv[i], "-m") == 0)    w.sizeSmall = atoi(value);
+        else if (strcmp(argv[i], "-M") == 0)    w.sizeLarge = atoi(value);
+        else if (strcmp(argv[i], "-l") == 0)    w.lifetimeDist = parse_dist(value);
+        else if (strcmp(argv[i], "-L") == 0)    w.lifetime = atoi(value);
+        else if (strcmp(argv[i], "-H") == 0)    w.hintThreshold = atol(value);
+        else if (strcmp(argv[i], "-o") == 0)    w.logPath = value;
+        else {
+            printf("unknown option: %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (w.sizeDist < DIST_FIXED || w.sizeDist > DIST_BIMODAL
+            || w.lifetimeDist < DIST_EXPONENTIAL || w.lifetimeDist > DIST_FIFO
+            || w.sizeSmall < 1 || w.lifetime < 1) {
+        printf("invalid distribution\n");
+        return 1;
+    }
+    if (w.interval <= 0) {
+        w.interval = w.ops / 20 > 0 ? w.ops / 20 : 1;
+    }
+#ifndef DM_EVENT_LOG
+    if (w.logPath != NULL) {
+        printf("-o needs dm_workload to be built with -DDM_EVENT_LOG\n");
+        return 1;
+    }
+#else
+    if (w.logPath != NULL) {
+        remove(w.logPath);
+    }
+#endif
+
+    srand(w.seed);
+    initialize_memory();
+
+    // Never more live objects than blocks.
+    objectCapacity = MEMORY_SIZE;
+    objects = (object*)malloc(sizeof(object) * objectCapacity);
+
+    counters c = { 0, 0, 0, 0 };
+    counters last = c;
+
+    printf("ops,live_objects,used_blocks,peak_blocks,used_pct,fragmentation_pct,failure_pct\n");
+    for (long op = 1; op <= w.ops; op++) {
+        if (w.lifetimeDist == DIST_LIFO || w.lifetimeDist == DIST_FIFO) {
+            step_ordered(&w, op, &c);
+        } else {
+            step_timed(&w, op, &c);
+        }
+
+#ifdef DM_EVENT_LOG
+        if (w.logPath != NULL && op % (DM_EVENT_LOG_SIZE / 4) == 0) {
+            dm_event_flush(w.logPath);
+        }
+#endif
+        if (op % w.interval == 0) {
+            report(op, &c, &last);
+            last = c;
+        }
+    }
+
+#ifdef DM_EVENT_LOG
+    if (w.logPath != NULL) {
+        dm_event_flush(w.logPath);
+    }
+#endif
+
+    printf("total,%ld,%d,%.2f,%.3f\n",
+            c.allocations,
+            c.peakBlocks,
+            100.0 * c.peakBlocks / MEMORY_SIZE,
+            c.allocations == 0 ? 0.0 : 100.0 * c.failures / c.allocations);
+
+    free(objects);
+    return 0;
+}
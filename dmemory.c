@@ -0,0 +1,13 @@
+/*
+ * Implementation file for programs that share one d_memory arena between
+ * several files, see 'Shared Arena' in dmemory.h.
+ *
+ * Build it once, with the same MEMORY_SIZE and DM_ options as the rest of
+ * the program:
+ *      gcc -std=gnu99 -O2 -DDM_SHARED_ARENA -c dmemory.c
+ */
+
+#include <stdio.h>
+
+#define DM_IMPLEMENTATION
+#include "dmemory.h"
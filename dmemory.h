@@ -61,6 +61,44 @@
 #ifndef __d_memory_h__
 #define __d_memory_h__
 
+#include <string.h> // for memcpy() and strcmp()
+
+/*
+ * Shared Arena:
+ *
+ * By default every file that includes this one gets its own static arena
+ * and its own copy of every function, which suits single file RobotC
+ * programs.  Programs split over several files define DM_SHARED_ARENA, and
+ * the same MEMORY_SIZE and DM_ options, in all of them and compile
+ * dmemory.c once, or define DM_IMPLEMENTATION in exactly one of their files
+ * before including this one.  That file owns the arena and the functions,
+ * the others only see declarations, so all of them share one pool.
+ *
+ * The bit helpers and dmalloc(), dmalloc_array() and dmalloc_hint() are
+ * static inline in every file, so callers can still inline them.
+ */
+#if defined(DM_SHARED_ARENA) && !defined(DM_IMPLEMENTATION)
+#define __DM_EXTERN         // this file only sees declarations
+#define __DM_STATE extern
+#elif defined(DM_SHARED_ARENA)
+#define __DM_STATE
+#else
+#define __DM_STATE static
+#endif
+
+#ifndef __DM_EXTERN
+#include "bitscan.h" // for bitscan_find_not_full() and bitscan_popcount()
+#endif
+
+// Functions generated by stack_dm.h and array_dm.h, and those of
+// trajectory_dm.h, are static in shared arena programs so every file can
+// include them.
+#ifdef DM_SHARED_ARENA
+#define __DM_HEADER_FUNCTION static inline
+#else
+#define __DM_HEADER_FUNCTION
+#endif
+
 // An 8 byte chunk
 typedef void* block;
 // A 1 byte chunk
@@ -72,9 +110,35 @@ typedef unsigned char byte;
 #define MEMORY_SIZE 512 // in blocks
 #endif
 
-// Array declarations.
-static block __d_memory [MEMORY_SIZE];
-static byte __free_memory [MEMORY_SIZE / 8];
+/*
+ * Block indices and sizes are dm_index.  An int holds every index of an
+ * arena below 2^31 blocks and keeps the bookkeeping small on RobotC, larger
+ * arenas (or defining DM_LARGE_ARENA) switch to 64 bit indices.
+ */
+#if !defined(DM_LARGE_ARENA) && MEMORY_SIZE > 0x7fffffc0
+#define DM_LARGE_ARENA
+#endif
+
+#ifdef DM_LARGE_ARENA
+typedef long long dm_index;
+#if defined(DM_TLSF)
+#error "DM_TLSF keeps int indices, it does not support DM_LARGE_ARENA"
+#endif
+#if defined(DM_EVENT_LOG)
+#error "the DM_EVENT_LOG file format has 32 bit indices, it does not support DM_LARGE_ARENA"
+#endif
+#else
+typedef int dm_index;
+#endif
+
+// Array declarations, moved into __dm_arena when the arena is mapped, see
+// 'Arena Fork' and 'Shared Memory Arena'.
+#if defined(DM_COW_FORK) || defined(DM_SHM_ARENA)
+#define __DM_MAPPED_ARENA
+#else
+__DM_STATE block __d_memory [MEMORY_SIZE];
+__DM_STATE byte __free_memory [MEMORY_SIZE / 8];
+#endif
 
 // Custom boolean declaration as to not conflict with RobotC'c bool type.
 typedef unsigned char __bool;
@@ -83,6 +147,746 @@ typedef unsigned char __bool;
 
 #define EMPTY 0
 
+// Lifetime hints for dmalloc_hint().
+#define DM_SHORT_LIVED  0
+#define DM_LONG_LIVED   1
+
+// Number of blocks walked by the last call to __find_free_chunk(),
+// always 0 with DM_TLSF.  Kept per thread with DM_SHARDS.
+#ifdef DM_SHARDS
+__DM_STATE __thread dm_index __last_scan_length;
+#else
+__DM_STATE dm_index __last_scan_length;
+#endif
+
+// Running allocation counters, enable by defining DM_STATS before
+// including this file.  Reset with dm_stats_reset().
+#ifdef DM_STATS
+typedef struct {
+    unsigned long allocations;  // calls to __find_free_chunk()
+    unsigned long failures;     // calls that returned NULL
+    unsigned long frees;        // calls to dmfree() and dmfree_array()
+    unsigned long long scanTotal;
+    dm_index scanMax;
+} dm_stats;
+
+#ifndef __DM_EXTERN
+static dm_stats __stats;
+#endif
+
+void dm_stats_reset ();
+dm_stats dm_stats_get ();
+#endif
+
+/*
+ * TLSF Backend:
+ *
+ * By default __find_free_chunk() scans __free_memory from the start for
+ * the first fit, which takes time proportional to how full the arena is.
+ * Defining DM_TLSF before including this file replaces the scan with the
+ * two level segregated fit allocator from tlsf.h, which allocates and frees
+ * in bounded time however full or fragmented __d_memory is.
+ *
+ * TLSF keeps __free_memory up to date so the rest of this file works as
+ * before.  Its free lists need 3 extra ints per block, kept outside of
+ * __d_memory.
+ */
+#if defined(DM_TLSF) && !defined(__DM_EXTERN)
+
+#include "tlsf.h"
+
+static int __tlsf_tags [MEMORY_SIZE];
+static int __tlsf_next_free [MEMORY_SIZE];
+static int __tlsf_prev_free [MEMORY_SIZE];
+static tlsf __tlsf_state;
+
+#elif !defined(DM_TLSF)
+
+/*
+ * Free run summaries of __free_memory, one per 64 blocks (a word), kept up
+ * to date by __set_blocks():
+ *
+ *      prefix      free blocks at the bottom of the word
+ *      suffix      free blocks at the top of the word
+ *      longest     longest run of free blocks inside the word
+ *
+ * A request of n blocks fits in a word if longest >= n, and straddles its
+ * start if the run carried in from the words before plus prefix >= n, so
+ * __first_fit() only looks at the bits of a word that is known to fit.
+ */
+typedef struct {
+    byte prefix;
+    byte suffix;
+    byte longest;
+} __word_summary;
+
+#ifndef __DM_EXTERN
+#ifndef __DM_MAPPED_ARENA
+static __word_summary __free_summary [(MEMORY_SIZE + 63) / 64];
+#endif
+
+void __summarize_word (dm_index w);
+#endif
+
+#endif
+
+/*
+ * Arena Fork:
+ *
+ * Defining DM_COW_FORK before including this file lets a what-if
+ * simulation run on a copy of the arena.  dm_fork() remaps __d_memory,
+ * __free_memory and the word summaries copy-on-write, after which
+ * allocations, frees and writes through arena pointers only change
+ * private copies of the pages they touch.  dm_fork_discard() throws those
+ * copies away and the arena is exactly as it was at dm_fork(), with every
+ * pointer into it still valid.
+ *
+ * The first dm_fork() copies the arena once into an unlinked POSIX shared
+ * memory object that backs it from then on.  The arena lives in __dm_arena,
+ * a page aligned union padded to whole pages of DM_PAGE_SIZE bytes.
+ * Slab and reserve state are saved and restored along with it and queued
+ * frees are flushed first.  Container structs kept outside of __d_memory
+ * are not covered, so run the simulation on copies of them.  Stats, trace
+ * and event log counters keep the operations of the simulation.
+ *
+ * Forks do not nest.  Needs mmap() and shm_open() (add -lrt on glibc older
+ * than 2.34) and is not available with DM_TLSF, whose free lists live
+ * outside of the arena.
+ */
+
+/*
+ * Shared Memory Arena:
+ *
+ * Defining DM_SHM_ARENA places __dm_arena, laid out as for DM_COW_FORK, in
+ * a POSIX shared memory object so several processes allocate from and read
+ * the same arena.  Every process calls dm_shm_attach() with the same name
+ * instead of initialize_memory(), the first one creates and initializes the
+ * arena.  Allocations and frees take a lock kept in the arena, which
+ * records the pid of its holder so a process that dies holding it does not
+ * block the others.
+ *
+ * The arena may be mapped at a different address in each process, so only
+ * block indices may be passed between them, see dm_index_of().  Stacks and
+ * arrays are handed over with share_stack_TYPE() and adopt_stack_TYPE()
+ * (or the _array_ versions), which swap the container struct for a header
+ * in the arena, so the elements themselves are never copied.  The fixed
+ * capacity containers copy their elements into the arena instead.  Persistent
+ * stacks and trajectories link their nodes with pointers and can not be
+ * shared.
+ *
+ * MEMORY_SIZE and the DM_ options must match in every process.  Not
+ * available with DM_TLSF or DM_SLAB, whose state is kept per process, or
+ * with DM_COW_FORK.
+ */
+#ifdef __DM_MAPPED_ARENA
+
+#ifdef DM_TLSF
+#error "DM_COW_FORK and DM_SHM_ARENA do not cover the DM_TLSF free lists"
+#endif
+
+// Must be a multiple of the system page size.
+#ifndef DM_PAGE_SIZE
+#define DM_PAGE_SIZE 4096
+#endif
+
+#ifndef __DM_EXTERN
+#include <fcntl.h>      // for O_CREAT
+#include <sys/mman.h>   // for mmap() and shm_open()
+#include <unistd.h>     // for ftruncate() and sysconf()
+#endif
+
+typedef struct {
+#ifdef DM_SHM_ARENA
+    int lock;                       // pid of the process holding it, 0 if free
+    int ready;                      // set once the creator initialized the arena
+    unsigned long long memorySize;  // MEMORY_SIZE of the creator
+    dm_index reserveStart;          // DM_RECLAIM reserve, see __reserve_start
+#endif
+    block memory [MEMORY_SIZE];
+    byte used [MEMORY_SIZE / 8];
+    __word_summary summary [(MEMORY_SIZE + 63) / 64];
+} __dm_arena_data;
+
+typedef union {
+    __dm_arena_data data;
+    byte pages [(sizeof(__dm_arena_data) + DM_PAGE_SIZE - 1) / DM_PAGE_SIZE * DM_PAGE_SIZE];
+} __dm_arena_pages;
+
+__DM_STATE __dm_arena_pages __dm_arena __attribute__((aligned(DM_PAGE_SIZE)));
+
+#define __d_memory      (__dm_arena.data.memory)
+#define __free_memory   (__dm_arena.data.used)
+#define __free_summary  (__dm_arena.data.summary)
+
+#endif
+
+#ifdef DM_COW_FORK
+
+#ifdef DM_SHM_ARENA
+#error "DM_COW_FORK can not fork a DM_SHM_ARENA arena"
+#endif
+
+__bool dm_fork ();
+void dm_fork_discard ();
+__bool dm_fork_active ();
+
+#endif
+
+#ifdef DM_SHM_ARENA
+
+#ifdef DM_SLAB
+#error "DM_SHM_ARENA does not share the DM_SLAB state"
+#endif
+
+#ifndef __DM_EXTERN
+#include <errno.h>  // for ESRCH
+#include <sched.h>  // for sched_yield()
+#include <signal.h> // for kill()
+#include <sys/stat.h> // for fstat()
+#endif
+
+__bool dm_shm_attach (const char* name);
+void dm_shm_detach ();
+int dm_shm_unlink (const char* name);
+
+#endif
+
+/*
+ * Threads:
+ *
+ * Defining DM_THREADS before including this file lets the threads of a
+ * program allocate from and free to the arena at the same time.  Calls that
+ * reach the global bitmap take a lock, as with DM_SHM_ARENA.
+ *
+ * In front of the lock every thread keeps a cache of runs of up to
+ * DM_THREAD_CACHE_MAX (4) blocks, handed out again without locking.  A run
+ * is owned by the thread that allocated it, recorded in __thread_owner.
+ * Freeing a run owned by the calling thread puts it in that thread's cache.
+ * Freeing a run owned by another thread pushes it onto the owner's remote
+ * free queue with a compare and swap, and the owner moves its queue into its
+ * cache the next time the cache is empty.  A stack, array or persistent
+ * stack filled by one thread is handed to another by passing the struct,
+ * nothing is copied, and the receiver frees it like its own.  A receiver that
+ * keeps the runs it was handed calls dm_thread_adopt() on them, so freeing
+ * them later stays in its own cache.
+ *
+ * Up to DM_MAX_THREADS (64) threads get a cache, the others always take the
+ * lock.  A thread calls dm_thread_exit() before it ends, which gives its
+ * cache back to the arena and its cache slot to the next thread.  Cached runs
+ * count as in use.  Call initialize_memory() before starting any threads.
+ * Cache hits are not counted by DM_STATS, DM_EVENT_LOG or
+ * DM_LATENCY_HISTOGRAM.
+ *
+ * Needs GCC style __thread and __atomic builtins.  Not available with
+ * DM_SHM_ARENA or DM_COW_FORK, which remap the arena under the program, or
+ * with DM_TRACE or DM_CHECKPOINT, which update their tables without the lock.
+ */
+#ifdef DM_THREADS
+
+#if defined(DM_SHM_ARENA) || defined(DM_COW_FORK)
+#error "DM_THREADS does not support DM_SHM_ARENA or DM_COW_FORK, which remap the arena"
+#endif
+#if defined(DM_TRACE) || defined(DM_CHECKPOINT)
+#error "DM_TRACE and DM_CHECKPOINT are not thread safe, they do not support DM_THREADS"
+#endif
+
+// Most threads with a cache at once, one bit of __thread_slots each.
+#ifndef DM_MAX_THREADS
+#define DM_MAX_THREADS 64
+#endif
+#if DM_MAX_THREADS > 64
+#error "DM_MAX_THREADS can not be more than 64"
+#endif
+
+// Runs cached per thread for each size.
+#ifndef DM_THREAD_CACHE_SIZE
+#define DM_THREAD_CACHE_SIZE 64
+#endif
+
+// Largest run kept in a cache, its size - 1 is stored in the low 2 bits
+// of a remote free queue link.
+#define DM_THREAD_CACHE_MAX 4
+
+#ifndef __DM_EXTERN
+#include <sched.h>  // for sched_yield()
+#include <stdint.h> // for uintptr_t
+
+// Slot + 1 of the thread owning the run starting at each block, 0 if
+// none.  Only kept for runs of up to DM_THREAD_CACHE_MAX blocks.
+static byte __thread_owner [MEMORY_SIZE];
+// Bit n set while a thread has slot n.
+static unsigned long long __thread_slots = 0;
+// Runs freed by other threads, per slot, see __thread_remote_free().
+static block* __remote_frees [DM_MAX_THREADS];
+
+// Slot of the calling thread, -1 if it has none.
+static __thread int __thread_slot = -1;
+// Indices of the cached runs of n + 1 blocks.
+static __thread dm_index __thread_cache [DM_THREAD_CACHE_MAX][DM_THREAD_CACHE_SIZE];
+static __thread int __thread_cached [DM_THREAD_CACHE_MAX];
+#endif
+
+void dm_thread_adopt (block* start, dm_index size);
+void dm_thread_exit ();
+
+#endif
+
+/*
+ * Shards:
+ *
+ * With DM_THREADS every allocation and free that misses the thread caches
+ * takes the one arena lock.  Defining DM_SHARDS as a number of shards, e.g.
+ * -DDM_SHARDS=16, splits __free_memory into that many slices of whole words
+ * instead, each with its own lock and cursor, so threads working in
+ * different shards do not wait for each other.
+ *
+ * Every thread is given a home shard, round robin in the order threads first
+ * allocate, and allocates first fit within it.  When its home shard is full
+ * it steals from the others in turn.  As a last resort the whole arena is
+ * searched holding every shard lock, which also serves runs longer than a
+ * shard.  A free locks only the shards its run covers.  DM_LONG_LIVED
+ * allocations are placed at the end of the home shard.
+ *
+ * The cursor of a shard is its first word that may have free blocks, every
+ * word before it is full, so searches start there.  Small allocations end
+ * up spread over every shard, so a nearly full arena runs out of room for
+ * long runs sooner than without shards.
+ *
+ * Needs DM_THREADS.  Not available with DM_TLSF, DM_SLAB, DM_DEFERRED_FREE,
+ * DM_RECLAIM, DM_STATS or DM_LATENCY_HISTOGRAM, whose state covers the whole
+ * arena and is kept under the one lock.
+ */
+#ifdef DM_SHARDS
+
+#ifndef DM_THREADS
+#error "DM_SHARDS needs DM_THREADS"
+#endif
+#if defined(DM_TLSF) || defined(DM_SLAB) || defined(DM_DEFERRED_FREE) || defined(DM_RECLAIM)
+#error "DM_SHARDS does not support DM_TLSF, DM_SLAB, DM_DEFERRED_FREE or DM_RECLAIM"
+#endif
+#if defined(DM_STATS) || defined(DM_LATENCY_HISTOGRAM)
+#error "DM_SHARDS does not support DM_STATS or DM_LATENCY_HISTOGRAM"
+#endif
+#if DM_SHARDS < 1 || DM_SHARDS > (MEMORY_SIZE + 63) / 64
+#error "DM_SHARDS must be between 1 and the number of 64 block words"
+#endif
+
+#ifndef __DM_EXTERN
+// Padded to a cache line so the locks of neighbouring shards do not share one.
+typedef struct __attribute__((aligned(64))) {
+    int lock;           // 1 while a thread holds it
+    dm_index firstWord; // words [firstWord, endWord) of __free_memory
+    dm_index endWord;
+    dm_index cursor;    // every word before it is full
+} __shard;
+
+static __shard __shards [DM_SHARDS];
+static unsigned int __shard_next = 0;   // home of the next thread
+static __thread int __shard_home = -1;  // home of the calling thread
+#endif
+
+#endif
+
+// Returns the index of a block of __d_memory, -1 for NULL.
+static inline dm_index dm_index_of (const void* item) {
+    return item == NULL ? -1 : (dm_index)((const block*)item - __d_memory);
+}
+
+// Returns the block at index 'idx' of __d_memory, NULL for -1.
+static inline block* dm_block_at (dm_index idx) {
+    return idx < 0 ? NULL : &__d_memory[idx];
+}
+
+/*
+ * Checkpoints:
+ *
+ * Defining DM_CHECKPOINT before including this file keeps a dirty bit per
+ * region of DM_CHECKPOINT_REGION (64) blocks, set whenever blocks of the
+ * region are allocated or freed and by the stack, array, persistent stack
+ * and trajectory functions that write to __d_memory.  Code that writes
+ * through arena pointers itself marks what it wrote with dm_mark_dirty().
+ *
+ * dm_checkpoint_write() appends a checkpoint to a file: a dm_checkpoint_header
+ * followed by one record per region, the region index as an unsigned long
+ * long, its blocks and its bytes of __free_memory.  The first checkpoint of
+ * a file holds every region, the following ones only the regions dirtied
+ * since the one before, so a file is a chain that dm_checkpoint_restore()
+ * replays in order.  dm_checkpoint_compact() merges a chain into a single
+ * checkpoint holding the latest copy of every region.
+ *
+ * Blocks are saved as they are, so pointers stored in __d_memory (e.g. the
+ * links of persistent stacks and trajectories) are only valid when restored
+ * into the same arena address.  Container structs outside of __d_memory are
+ * not saved.  Not available with DM_TLSF or DM_SLAB, whose state is kept
+ * outside of the arena.
+ */
+#define DM_CHECKPOINT_MAGIC     0x4b434d44 // "DMCK"
+#define DM_CHECKPOINT_VERSION   1
+#define DM_CHECKPOINT_REGION    64
+
+// Written at the start of every checkpoint.
+typedef struct {
+    unsigned int magic;
+    unsigned int version;
+    unsigned long long memorySize;  // MEMORY_SIZE of the writing program
+    unsigned long long regions;     // records that follow
+} dm_checkpoint_header;
+
+#ifdef DM_CHECKPOINT
+
+#if defined(DM_TLSF) || defined(DM_SLAB)
+#error "DM_CHECKPOINT does not save the DM_TLSF or DM_SLAB state"
+#endif
+
+#include <stdint.h> // for uintptr_t
+
+#define __DM_CHECKPOINT_REGIONS ((MEMORY_SIZE + DM_CHECKPOINT_REGION - 1) / DM_CHECKPOINT_REGION)
+
+// Bit r set if region r changed since the last checkpoint.
+__DM_STATE byte __dirty_regions [(__DM_CHECKPOINT_REGIONS + 7) / 8];
+
+// Marks the regions holding 'size' blocks from 'start' as dirty.  Pointers
+// outside of __d_memory, e.g. a stack still in its inline buffer, are
+// ignored.
+static inline void dm_mark_dirty (const void* start, dm_index size) {
+    const uintptr_t offset = (uintptr_t)start - (uintptr_t)__d_memory;
+    if (offset >= sizeof(block) * (uintptr_t)MEMORY_SIZE || size <= 0) {
+        return;
+    }
+    const dm_index first = (dm_index)(offset / sizeof(block)) / DM_CHECKPOINT_REGION;
+    dm_index last = ((dm_index)(offset / sizeof(block)) + size - 1) / DM_CHECKPOINT_REGION;
+    if (last >= __DM_CHECKPOINT_REGIONS) {
+        last = __DM_CHECKPOINT_REGIONS - 1;
+    }
+    for (dm_index r = first; r <= last; r++) {
+        __dirty_regions[r / 8] |= (byte)(1 << (r % 8));
+    }
+}
+
+int dm_checkpoint_write (const char* path);
+int dm_checkpoint_restore (const char* path);
+int dm_checkpoint_compact (const char* path, const char* out);
+
+#define __DM_MARK_DIRTY(start, size) dm_mark_dirty((start), (size))
+#else
+#define __DM_MARK_DIRTY(start, size)
+#endif
+
+/*
+ * Slabs:
+ *
+ * Single blocks and other small allocations scattered through the arena
+ * break up the free runs that arrays need.  Defining DM_SLAB before
+ * including this file serves requests of up to DM_SLAB_MAX_SLOT blocks from
+ * slabs instead: runs of DM_SLAB_SLOTS slots reserved from the global
+ * bitmap in one go, so small allocations sit together.
+ *
+ * Each slab tracks its slots in a single 64 bit occupancy word, so finding
+ * a free slot never touches __free_memory.  Slots are 1, 2 or 4 blocks,
+ * requests of 3 blocks get a 4 block slot.  A whole slab counts as used in
+ * __free_memory and amount_memory_used().
+ *
+ * Slabs may only be freed a whole slot at a time, with the first block and
+ * size of the allocation.  dmfree_array() of part of a slot, e.g. the unused
+ * tail of a container, is ignored and the slot stays in use until it is
+ * freed whole, so the stack and array shrink functions leave allocations
+ * this small alone.
+ */
+#ifdef DM_SLAB
+
+// Maximum number of slabs, small allocations go to the global bitmap
+// once all are in use.
+#ifndef DM_SLAB_MAX
+#define DM_SLAB_MAX 32
+#endif
+
+#define DM_SLAB_SLOTS       64  // one bit of the occupancy word per slot
+#define DM_SLAB_CLASSES     3   // slots of 1, 2 and 4 blocks
+#define DM_SLAB_MAX_SLOT    4
+
+#ifndef __DM_EXTERN
+typedef struct {
+    dm_index start;                 // first block of the slab
+    int slotSize;                   // in blocks
+    unsigned long long occupied;    // bit n set if slot n is in use
+} __slab;
+
+static __slab __slabs [DM_SLAB_MAX];    // sorted by start
+static int __slab_count = 0;
+// Position of the slab last allocated from per class, -1 if none.
+static int __slab_current [DM_SLAB_CLASSES] = { -1, -1, -1 };
+#endif
+
+#endif
+
+/*
+ * Deferred Frees:
+ *
+ * Every dmfree() and dmfree_array() normally clears its bits of
+ * __free_memory straight away, a scattered read-modify-write each.
+ * Defining DM_DEFERRED_FREE before including this file queues frees
+ * instead and applies them in one batch when the queue fills up, when an
+ * allocation would otherwise fail, or when dm_deferred_flush() is called,
+ * e.g. once per tick.
+ *
+ * A batch is sorted by index and adjacent frees are merged, so a run freed
+ * piece by piece is cleared with whole bytes and its word summaries (or
+ * TLSF free lists) are updated once.  Until then queued blocks still count
+ * as in use, so they are never handed out twice, and amount_memory_used()
+ * includes them.
+ */
+#ifdef DM_DEFERRED_FREE
+
+// Number of frees queued before they are applied.
+#ifndef DM_DEFERRED_FREE_SIZE
+#define DM_DEFERRED_FREE_SIZE 256
+#endif
+
+#ifndef __DM_EXTERN
+typedef struct {
+    dm_index index;
+    dm_index size;
+} __deferred_free;
+
+static __deferred_free __deferred_frees [DM_DEFERRED_FREE_SIZE];
+static int __deferred_count = 0;
+#endif
+
+void dm_deferred_flush ();
+
+#endif
+
+/*
+ * Reclaim:
+ *
+ * By default an allocation that does not fit fails straight away.
+ * Defining DM_RECLAIM before including this file gives the program a
+ * chance to make room first: callbacks registered with dm_reclaim_register()
+ * are called in priority order, lowest first, until one frees enough for the
+ * allocation to succeed on retry.  Caches that can drop entries or arrays
+ * that can shrink_to_fit() are good candidates.
+ *
+ * If every callback has run and the allocation still fails, an emergency
+ * reserve of DM_RESERVE_BLOCKS, set aside by initialize_memory(), is given
+ * back to the arena and the allocation retried once more.  Take the reserve
+ * back with dm_reserve_restore() once the spike has passed.
+ */
+#ifdef DM_RECLAIM
+
+// Maximum number of registered callbacks.
+#ifndef DM_RECLAIM_MAX
+#define DM_RECLAIM_MAX 8
+#endif
+
+// Size of the emergency reserve, 0 for none.
+#ifndef DM_RESERVE_BLOCKS
+#define DM_RESERVE_BLOCKS 0
+#endif
+
+// Called when an allocation of 'needed' blocks fails, should free what it
+// can spare and return the number of blocks it freed.
+typedef dm_index (*dm_reclaim_callback) (dm_index needed, void* context);
+
+#ifndef __DM_EXTERN
+typedef struct {
+    dm_reclaim_callback callback;
+    void* context;
+    int priority;
+} __reclaimer;
+
+static __reclaimer __reclaimers [DM_RECLAIM_MAX];  // sorted by priority
+static int __reclaimer_count = 0;
+static __bool __reclaiming = NO;    // set while the callbacks run
+#ifdef DM_SHM_ARENA
+// Kept in the shared arena, so the reserve set aside by the creating
+// process is the only one.
+#define __reserve_start (__dm_arena.data.reserveStart)
+#else
+static dm_index __reserve_start = -1; // first block of the reserve, -1 if released
+#endif
+
+dm_index __chunk_alloc (dm_index numBlocks, int hint);
+#endif
+
+__bool dm_reclaim_register (dm_reclaim_callback callback, void* context, int priority);
+void dm_reclaim_unregister (dm_reclaim_callback callback, void* context);
+__bool dm_reserve_restore ();
+__bool dm_reserve_released ();
+
+#endif
+
+/*
+ * Capacity Hints:
+ *
+ * A stack or array made with make_stack_site_TYPE(site) or
+ * make_array_site_TYPE(site) records the most elements it held under
+ * 'site' when it is deleted.  'site' is a number from 0 to
+ * DM_CAPACITY_SITES - 1 that the program picks for each place it makes
+ * containers.  The next container made for that site starts at the
+ * recorded capacity, so a per tick container that always grows to the
+ * same size is no longer resized on the way.
+ *
+ * A larger peak replaces the hint at once.  A smaller one only lowers it by
+ * an eighth of the difference, so a site whose peak varies settles near its
+ * largest recent peak.
+ *
+ * Enable by defining DM_CAPACITY_HINTS before including this file, without
+ * it the _site constructors ignore the site.
+ */
+#ifdef DM_CAPACITY_HINTS
+
+// Number of sites.
+#ifndef DM_CAPACITY_SITES
+#define DM_CAPACITY_SITES 16
+#endif
+
+#ifndef __DM_EXTERN
+static dm_index __capacity_hints [DM_CAPACITY_SITES]; // in elements, 0 if unknown
+#endif
+
+dm_index dm_capacity_hint (int site);
+void dm_capacity_record (int site, dm_index peak);
+
+#endif
+
+// Allocation tracing, see 'Tracing' at the bottom of this file.
+//
+// Enable by defining DM_TRACE before including this file.
+#ifdef DM_TRACE
+
+// Size of the call site table.  The last entry is kept for "(other)",
+// which collects the sites that do not fit in the rest of the table.
+#ifndef DM_TRACE_MAX_SITES
+#define DM_TRACE_MAX_SITES 32
+#endif
+#if DM_TRACE_MAX_SITES < 2
+#error "DM_TRACE_MAX_SITES must leave room for a site and \"(other)\""
+#endif
+
+#ifndef __DM_EXTERN
+typedef struct {
+    const char* file;
+    int line;
+    dm_index liveBlocks;    // blocks currently allocated from this site
+    int allocations;        // total allocations
+    int recentAllocations;  // allocations since the last dump
+    int failures;           // allocations that returned NULL
+} __trace_site;
+
+static __trace_site __trace_sites [DM_TRACE_MAX_SITES];
+static int __trace_site_count = 0;
+// Index + 1 of the site that owns each block, 0 if untracked.
+static byte __trace_owner [MEMORY_SIZE];
+// Site of the allocation that is currently in progress, -1 if none.
+static int __trace_current_site = -1;
+#endif
+
+void dm_trace_dump ();
+block* __trace_dmalloc_array (dm_index size, int hint, const char* file, int line);
+void __trace_dmfree_array (block* start, dm_index size);
+
+#endif
+
+// Allocation event log, see 'Event Log' at the bottom of this file.
+//
+// Record layout is shared with dm_replay.c, enable recording by defining
+// DM_EVENT_LOG before including this file.
+#define DM_EVENT_ALLOC  0
+#define DM_EVENT_FREE   1
+#define DM_EVENT_FAIL   2
+
+#define DM_EVENT_MAGIC      0x56454d44 // "DMEV"
+#define DM_EVENT_VERSION    1
+
+typedef struct {
+    unsigned long long timestamp;   // in nanoseconds
+    unsigned int index;             // first block, 0 for failed allocations
+    unsigned int size;              // in blocks
+    unsigned char op;               // DM_EVENT_ALLOC, DM_EVENT_FREE or DM_EVENT_FAIL
+} dm_event;
+
+// Written once at the start of every event log file.
+typedef struct {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int memorySize;        // MEMORY_SIZE of the recording program
+    unsigned int reserved;
+} dm_event_header;
+
+#ifdef DM_EVENT_LOG
+
+#include <time.h> // for clock_gettime()
+
+// Number of events held before the oldest are overwritten, must be a power of 2.
+#ifndef DM_EVENT_LOG_SIZE
+#define DM_EVENT_LOG_SIZE 4096
+#endif
+
+#ifndef __DM_EXTERN
+static dm_event __event_log [DM_EVENT_LOG_SIZE];
+static unsigned long __event_head = 0;      // total events recorded
+static unsigned long __event_tail = 0;      // total events flushed or dropped
+static unsigned long __event_dropped = 0;   // events overwritten before a flush
+#endif
+
+int dm_event_flush (const char* path);
+unsigned long dm_event_dropped ();
+
+#endif
+
+// Latency histograms, see 'Latency Histograms' at the bottom of this file.
+//
+// Enable by defining DM_LATENCY_HISTOGRAM before including this file.
+#ifdef DM_LATENCY_HISTOGRAM
+
+#include <time.h> // for clock_gettime()
+
+// Time one in every DM_LATENCY_SAMPLE_RATE operations.
+#ifndef DM_LATENCY_SAMPLE_RATE
+#define DM_LATENCY_SAMPLE_RATE 1
+#endif
+
+// Each power of two is split into 2^DM_HISTOGRAM_SUB_BITS linear buckets,
+// giving a worst case error of 1 / 2^DM_HISTOGRAM_SUB_BITS.
+#define DM_HISTOGRAM_SUB_BITS   3
+#define DM_HISTOGRAM_SUB_COUNT  (1 << DM_HISTOGRAM_SUB_BITS)
+#define DM_HISTOGRAM_BUCKETS    ((64 - DM_HISTOGRAM_SUB_BITS + 1) * DM_HISTOGRAM_SUB_COUNT)
+
+typedef struct {
+    unsigned long long counts [DM_HISTOGRAM_BUCKETS];
+    unsigned long long total;
+    unsigned long long min;
+    unsigned long long max;
+} dm_histogram;
+
+// Histograms kept, pass to dm_histogram_get().
+#define DM_HISTOGRAM_ALLOC  0   // __find_free_chunk() latency
+#define DM_HISTOGRAM_FREE   1   // dmfree() and dmfree_array() latency
+#define DM_HISTOGRAM_SCAN   2   // __find_free_chunk() scan length in blocks
+#define DM_HISTOGRAM_COUNT  3
+
+#ifndef __DM_EXTERN
+static dm_histogram __histograms [DM_HISTOGRAM_COUNT];
+static unsigned long __latency_ops = 0;
+#endif
+
+dm_histogram* dm_histogram_get (int which);
+unsigned long long dm_histogram_percentile (const dm_histogram* h, double percentile);
+void dm_histogram_reset (dm_histogram* h);
+void dm_histograms_reset ();
+void dm_histograms_print ();
+
+#endif
+
+// Defined once, in the file that owns the arena, see 'Shared Arena'.
+void initialize_memory ();
+block* __find_free_chunk (dm_index numBlocks, int hint);
+void dmfree (block* item);
+void dmfree_array (block* start, dm_index size);
+int amount_memory_used ();
+void print_memory ();
+void __memory_error (const char* msg);
+
 // Array coefficients, see 'Problems' for use.
 #define INTCOEF 	(sizeof(block) / sizeof(int))
 #define CHARCOEF 	(sizeof(block) / sizeof(char))
@@ -109,7 +913,7 @@ typedef unsigned char __bool;
  *      idx % 8 = 7
  *          returns bx10000000
  */
-byte __bit_encoder (int idx) {
+static inline byte __bit_encoder (dm_index idx) {
     return (byte)(1 << (idx % 8));
 }
 
@@ -134,8 +938,8 @@ byte __bit_encoder (int idx) {
  *
  *    Result is original with isolated bit set to 1
  */
-void __set_block_used (int idx) {
-    int idx_converted = idx / 8;
+static inline void __set_block_used (dm_index idx) {
+    dm_index idx_converted = idx / 8;
     __free_memory[idx_converted] = __free_memory[idx_converted] | __bit_encoder(idx);
 }
 
@@ -165,8 +969,8 @@ void __set_block_used (int idx) {
  *
  *      Result is original with isolated bit set to 0
  */
-void __set_block_free (int idx) {
-    int idx_helper = idx / 8;
+static inline void __set_block_free (dm_index idx) {
+    dm_index idx_helper = idx / 8;
     __free_memory[idx_helper] = __free_memory[idx_helper] & (~__bit_encoder(idx));
 }
 
@@ -197,60 +1001,1219 @@ void __set_block_free (int idx) {
  *      bx00000000 = 0 which fails the ternary operation so we return 1
  *                   as this space is free.
  */
-__bool __check_block_free (int idx) {
-    int idx_helper = idx / 8;
+static inline __bool __check_block_free (dm_index idx) {
+    dm_index idx_helper = idx / 8;
     return __free_memory[idx_helper] & __bit_encoder(idx) ? (__bool)0:(__bool)1;
 }
 
-// Sets all blocks in __d_memory to NULL and all slots as free.
+// Finds, allocates, and returns a pointer to, a single free block.
+static inline block* dmalloc () {
+	return __find_free_chunk(1, DM_SHORT_LIVED);
+}
+
+// Finds, allocates, and returns a pointer to the
+// first element of a section of free blocks.
+static inline block* dmalloc_array (dm_index size) {
+	return __find_free_chunk(size, DM_SHORT_LIVED);
+}
+
+// Same as dmalloc_array() with a hint of how long the section will live.
+//
+// DM_SHORT_LIVED sections are placed from the start of __d_memory, like
+// dmalloc_array(), and DM_LONG_LIVED sections from the end, so maps and
+// other data kept for the whole program do not end up between scratch
+// arrays and split the free space between them.  Ignored with DM_TLSF,
+// which does not place by address.
+static inline block* dmalloc_hint (dm_index size, int hint) {
+	return __find_free_chunk(size, hint);
+}
+
+// Blocks of the header share_stack_TYPE() and share_array_TYPE() leave in
+// __d_memory: size, capacity and the index of the elements.
+#define __HANDOFF_BLOCKS ((dm_index)((3 * sizeof(dm_index) + sizeof(block) - 1) / sizeof(block)))
+
+// Stores a container in a new handoff header.
+// Returns the index of the header or -1 if there is no room for it.
+static inline dm_index __handoff_store (dm_index size, dm_index capacity, const void* data) {
+    dm_index* header = (dm_index*)dmalloc_array(__HANDOFF_BLOCKS);
+    if (header == NULL) {
+        return -1;
+    }
+    header[0] = size;
+    header[1] = capacity;
+    header[2] = dm_index_of(data);
+    return dm_index_of(header);
+}
+
+// Frees the handoff header at 'handle' and returns the container it held.
+static inline block* __handoff_take (dm_index handle, dm_index* size, dm_index* capacity) {
+    dm_index* header = (dm_index*)dm_block_at(handle);
+    *size = header[0];
+    *capacity = header[1];
+    block* data = dm_block_at(header[2]);
+    dmfree_array((block*)header, __HANDOFF_BLOCKS);
+    return data;
+}
+
+#ifndef __DM_EXTERN
+
+void __initialize_process_state ();
+
+// Sets all blocks in __d_memory to NULL and all slots as free.
 //
 // Call once at the start of the program.
 void initialize_memory () {
-	for (int i = 0; i < MEMORY_SIZE; i++) {
+	for (dm_index i = 0; i < MEMORY_SIZE; i++) {
 		__d_memory[i] = NULL;
         if (i < MEMORY_SIZE / 8) {
             __free_memory[i] = EMPTY;
         }
-	}
+	}
+#ifdef DM_TLSF
+    tlsf_init(&__tlsf_state, MEMORY_SIZE, __free_memory,
+            __tlsf_tags, __tlsf_next_free, __tlsf_prev_free);
+#else
+    for (dm_index w = 0; w < (MEMORY_SIZE + 63) / 64; w++) {
+        __summarize_word(w);
+    }
+#endif
+#ifdef DM_SHARDS
+    for (int i = 0; i < DM_SHARDS; i++) {
+        __shards[i].lock = 0;
+        __shards[i].firstWord = (dm_index)((long long)i * ((MEMORY_SIZE + 63) / 64) / DM_SHARDS);
+        __shards[i].endWord = (dm_index)((long long)(i + 1) * ((MEMORY_SIZE + 63) / 64) / DM_SHARDS);
+        __shards[i].cursor = __shards[i].firstWord;
+    }
+#endif
+    __initialize_process_state();
+#ifdef DM_RECLAIM
+    __reserve_start = DM_RESERVE_BLOCKS > 0 ? __chunk_alloc(DM_RESERVE_BLOCKS, DM_LONG_LIVED) : -1;
+#endif
+}
+
+// Resets the state kept outside of the arena, which with DM_SHM_ARENA is
+// separate for every process.
+void __initialize_process_state () {
+    bitscan_select();
+#ifdef DM_DEFERRED_FREE
+    __deferred_count = 0;
+#endif
+#ifdef DM_SLAB
+    __slab_count = 0;
+    for (int i = 0; i < DM_SLAB_CLASSES; i++) {
+        __slab_current[i] = -1;
+    }
+#endif
+#ifdef DM_TRACE
+    for (dm_index i = 0; i < MEMORY_SIZE; i++) {
+        __trace_owner[i] = EMPTY;
+    }
+    __trace_site_count = 0;
+    __trace_current_site = -1;
+#endif
+#ifdef DM_EVENT_LOG
+    __event_head = 0;
+    __event_tail = 0;
+    __event_dropped = 0;
+#endif
+#ifdef DM_LATENCY_HISTOGRAM
+    dm_histograms_reset();
+#endif
+#ifdef DM_STATS
+    dm_stats_reset();
+#endif
+#ifdef DM_CHECKPOINT
+    memset(__dirty_regions, 0xff, sizeof(__dirty_regions));
+#endif
+#ifdef DM_CAPACITY_HINTS
+    for (int i = 0; i < DM_CAPACITY_SITES; i++) {
+        __capacity_hints[i] = 0;
+    }
+#endif
+#ifdef DM_THREADS
+    memset(__thread_owner, EMPTY, sizeof(__thread_owner));
+    for (int i = 0; i < DM_MAX_THREADS; i++) {
+        __remote_frees[i] = NULL;
+    }
+    for (int i = 0; i < DM_THREAD_CACHE_MAX; i++) {
+        __thread_cached[i] = 0;
+    }
+#endif
+#ifdef DM_RECLAIM
+    __reclaimer_count = 0;
+#endif
+}
+
+// With DM_SHARDS the shards are locked instead, see __shard_lock().
+#if (defined(DM_SHM_ARENA) || defined(DM_THREADS)) && !defined(DM_SHARDS)
+#ifdef DM_SHM_ARENA
+static int __shm_fd = -1;
+static int __shm_pid = 0;
+static int __lock_depth = 0; // nested __dm_lock() calls of this process
+#define __DM_LOCK_WORD  (__dm_arena.data.lock)
+#define __DM_LOCK_OWNER __shm_pid
+#else
+static int __dm_lock_word = 0; // 1 while a thread holds the lock
+static __thread int __lock_depth = 0; // nested __dm_lock() calls of this thread
+#define __DM_LOCK_WORD  __dm_lock_word
+#define __DM_LOCK_OWNER 1
+#endif
+
+// Takes the arena lock, waiting for other processes or threads to release
+// it.  Calls from inside the lock, e.g. a reclaim callback freeing blocks,
+// nest.
+void __dm_lock () {
+    if (__lock_depth++ > 0) {
+        return;
+    }
+    int holder = 0;
+    while (!__atomic_compare_exchange_n(&__DM_LOCK_WORD, &holder, __DM_LOCK_OWNER,
+                NO, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+#ifdef DM_SHM_ARENA
+        // Take over from a holder that died.
+        if (holder != 0 && kill(holder, 0) != 0 && errno == ESRCH) {
+            if (__atomic_compare_exchange_n(&__DM_LOCK_WORD, &holder, __DM_LOCK_OWNER,
+                        NO, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                return;
+            }
+        }
+#endif
+        sched_yield();
+        holder = 0;
+    }
+}
+
+void __dm_unlock () {
+    if (--__lock_depth == 0) {
+        __atomic_store_n(&__DM_LOCK_WORD, 0, __ATOMIC_RELEASE);
+    }
+}
+
+#define __DM_LOCK()     __dm_lock()
+#define __DM_UNLOCK()   __dm_unlock()
+#else
+#define __DM_LOCK()
+#define __DM_UNLOCK()
+#endif
+
+#ifdef DM_EVENT_LOG
+// Returns a monotonic timestamp in nanoseconds.
+unsigned long long __dm_timestamp () {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+// Claims the next slot of the ring buffer and fills it in.
+//
+// The slot is claimed with an atomic increment so recording never blocks,
+// a slot that has not been flushed yet is simply overwritten.
+void __event_record (unsigned char op, dm_index index, dm_index size) {
+    const unsigned long slot = __atomic_fetch_add(&__event_head, 1, __ATOMIC_RELAXED);
+    dm_event* event = &__event_log[slot & (DM_EVENT_LOG_SIZE - 1)];
+    event->timestamp = __dm_timestamp();
+    event->index = (unsigned int)index;
+    event->size = (unsigned int)size;
+    event->op = op;
+}
+#endif
+
+#ifdef DM_LATENCY_HISTOGRAM
+// Returns the current time in the unit the histograms are kept in.
+//
+// Uses the time stamp counter on x86 (cycles) unless DM_LATENCY_USE_CLOCK
+// is defined, otherwise clock_gettime() (nanoseconds).
+unsigned long long __dm_cycles () {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(DM_LATENCY_USE_CLOCK)
+    unsigned int lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((unsigned long long)hi << 32) | lo;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+#endif
+}
+
+// Returns the start time of an operation if it should be sampled, 0 if not.
+unsigned long long __latency_start () {
+    if (++__latency_ops % DM_LATENCY_SAMPLE_RATE != 0) {
+        return 0;
+    }
+    return __dm_cycles();
+}
+
+/*
+ * Returns the bucket a value falls into.
+ *
+ * Values below DM_HISTOGRAM_SUB_COUNT get a bucket each, above that the
+ * bucket is picked by the position of the highest set bit and the
+ * DM_HISTOGRAM_SUB_BITS bits below it.
+ *
+ *  Example, DM_HISTOGRAM_SUB_BITS = 3:
+ *      value = 100 = bx1100100
+ *                      ^^^^ highest bit is 6, next 3 bits are 100
+ *      bucket = (6 - 3 + 1) * 8 + 4 = 36
+ */
+int __histogram_bucket (unsigned long long value) {
+    if (value < DM_HISTOGRAM_SUB_COUNT) {
+        return (int)value;
+    }
+#ifdef __GNUC__
+    const int msb = 63 - __builtin_clzll(value);
+#else
+    int msb = 0;
+    while ((value >> msb) > 1) {
+        ++msb;
+    }
+#endif
+    const int shift = msb - DM_HISTOGRAM_SUB_BITS;
+    return (shift + 1) * DM_HISTOGRAM_SUB_COUNT
+        + (int)((value >> shift) & (DM_HISTOGRAM_SUB_COUNT - 1));
+}
+
+// Returns the largest value that falls into the given bucket.
+unsigned long long __histogram_bucket_max (int bucket) {
+    if (bucket < DM_HISTOGRAM_SUB_COUNT) {
+        return (unsigned long long)bucket;
+    }
+    const int shift = bucket / DM_HISTOGRAM_SUB_COUNT - 1;
+    const unsigned long long sub = DM_HISTOGRAM_SUB_COUNT + bucket % DM_HISTOGRAM_SUB_COUNT;
+    return ((sub + 1) << shift) - 1;
+}
+
+void __histogram_record (int which, unsigned long long value) {
+    dm_histogram* h = &__histograms[which];
+    ++h->counts[__histogram_bucket(value)];
+    if (h->total == 0 || value < h->min) {
+        h->min = value;
+    }
+    if (value > h->max) {
+        h->max = value;
+    }
+    ++h->total;
+}
+
+// Records the latency of an operation that was started with __latency_start().
+void __latency_record (int which, unsigned long long start) {
+    if (start != 0) {
+        __histogram_record(which, __dm_cycles() - start);
+    }
+}
+#endif
+
+#ifdef DM_STATS
+// Clears the running allocation counters.
+void dm_stats_reset () {
+    __stats.allocations = 0;
+    __stats.failures = 0;
+    __stats.frees = 0;
+    __stats.scanTotal = 0;
+    __stats.scanMax = 0;
+}
+
+// Returns a copy of the running allocation counters.
+dm_stats dm_stats_get () {
+    return __stats;
+}
+
+// Adds the scan of the last allocation to the running counters.
+void __stats_record_scan () {
+    ++__stats.allocations;
+    __stats.scanTotal += __last_scan_length;
+    if (__last_scan_length > __stats.scanMax) {
+        __stats.scanMax = __last_scan_length;
+    }
+}
+#endif
+
+// Called if unable to allocate more memory.
+//
+// Define DM_QUIET before including this file to silence the message.
+void __memory_error (const char* msg) {
+#ifdef DM_TRACE
+    // Counted here so the dump below already includes this failure.
+    if (__trace_current_site >= 0) {
+        ++__trace_sites[__trace_current_site].failures;
+    }
+#endif
+#ifndef DM_QUIET
+    printf("Memory Error: %s", msg);
+#ifdef DM_TRACE
+    if (__trace_current_site >= 0) {
+        printf(" (at %s:%d)",
+                __trace_sites[__trace_current_site].file,
+                __trace_sites[__trace_current_site].line);
+    }
+    printf("\n");
+    dm_trace_dump();
+#endif
+    fflush(stdout);
+#else
+    (void)msg;
+#endif
+    // abort code here...
+}
+
+// Returns 64 blocks of __free_memory starting at block w * 64 as a word,
+// blocks past the end of __d_memory read as in use.
+unsigned long long __load_used_word (dm_index w) {
+    const dm_index first = w * 8;
+    if (first + 8 <= MEMORY_SIZE / 8) {
+        return bitscan_load64(__free_memory, first);
+    }
+    unsigned long long word = ~0ULL;
+    for (dm_index i = first; i < MEMORY_SIZE / 8; i++) {
+        word &= ~(0xffULL << (8 * (i - first)));
+        word |= (unsigned long long)__free_memory[i] << (8 * (i - first));
+    }
+    return word;
+}
+
+/*
+ * Returns a word with bit i set if a run of n free blocks that lies
+ * entirely within the word starts at block i.
+ *
+ * Bit i of 'free' is set if block i is free.  ANDing free with itself
+ * shifted right by k leaves bit i set only if blocks i to i + k are all free,
+ * repeating with doubling shifts finds runs of n in log2(n) steps.
+ */
+unsigned long long __run_starts (unsigned long long free, int n) {
+    int have = 1;
+    while (have < n && free != 0) {
+        const int step = have < n - have ? have : n - have;
+        free &= free >> step;
+        have += step;
+    }
+    return free;
+}
+
+// Returns the position of the first run of n free blocks that lies
+// entirely within a word, or -1 if there is none.
+int __run_in_word (unsigned long long free, int n) {
+    const unsigned long long starts = __run_starts(free, n);
+    return starts == 0 ? -1 : bitscan_ctz64(starts);
+}
+
+// Returns the position of the last run of n free blocks that lies
+// entirely within a word, or -1 if there is none.
+int __last_run_in_word (unsigned long long free, int n) {
+    const unsigned long long starts = __run_starts(free, n);
+    return starts == 0 ? -1 : 63 - bitscan_clz64(starts);
+}
+
+#ifndef DM_TLSF
+// Recomputes the summary of word w from __free_memory.
+void __summarize_word (dm_index w) {
+    const unsigned long long used = __load_used_word(w);
+    __word_summary* summary = &__free_summary[w];
+    if (used == 0) {
+        summary->prefix = summary->suffix = summary->longest = 64;
+        return;
+    }
+    summary->prefix = (byte)bitscan_ctz64(used);
+    summary->suffix = (byte)bitscan_clz64(used);
+
+    // Every step shortens each run of free bits by one, the number of steps
+    // until none are left is the length of the longest.
+    unsigned long long freeBlocks = ~used;
+    int longest = 0;
+    while (freeBlocks != 0) {
+        freeBlocks &= freeBlocks >> 1;
+        ++longest;
+    }
+    summary->longest = (byte)longest;
+}
+
+// Sets blocks [idx, idx + n) to be in use, or free if used is NO, a byte at
+// a time where possible, and updates the summaries of the words touched.
+void __set_blocks (dm_index idx, dm_index n, __bool used) {
+    const dm_index end = idx + n;
+    dm_index i = idx;
+    // Leading bits up to a byte boundary, whole bytes, then trailing bits.
+    for (; i < end && i % 8 != 0; i++) {
+        if (used) __set_block_used(i);
+        else      __set_block_free(i);
+    }
+    for (; i + 8 <= end; i += 8) {
+        __free_memory[i / 8] = used ? 0xff : EMPTY;
+    }
+    for (; i < end; i++) {
+        if (used) __set_block_used(i);
+        else      __set_block_free(i);
+    }
+
+    // Words covered completely are known without looking at them.
+    const byte whole = used ? 0 : 64;
+    for (dm_index w = idx / 64; w <= (end - 1) / 64; w++) {
+        if (w * 64 >= idx && w * 64 + 64 <= end && w * 64 + 64 <= MEMORY_SIZE) {
+            __free_summary[w].prefix = whole;
+            __free_summary[w].suffix = whole;
+            __free_summary[w].longest = whole;
+        } else {
+            __summarize_word(w);
+        }
+    }
+}
+
+// Looks for a section of free blocks the size of numBlocks that is all free,
+// starting from the beginning of __d_memory.
+// If it is able to find a suitable section, it sets the blocks to be in use
+// and returns the index of the first one.  If not, it returns -1.
+//
+// __free_memory is walked 64 blocks at a time using the word summaries in
+// __free_summary, so each word costs a few compares whatever its contents.
+// A run of free blocks is carried from word to word through their free
+// suffixes, and the bits of a word are only searched, by __run_in_word(),
+// once its summary says a run of numBlocks lies inside it.  Stretches of
+// words that are fully in use are skipped with bitscan_find_not_full(), 256
+// or 512 blocks per compare where AVX2 or AVX-512 are available.
+//
+// Only words [firstWord, endWord) are searched, see 'Shards'.
+dm_index __first_fit_range (dm_index numBlocks, dm_index firstWord, dm_index endWord) {
+    const dm_index endBlock = endWord * 64 < MEMORY_SIZE ? endWord * 64 : MEMORY_SIZE;
+    dm_index run = 0;       // free blocks directly before the current word
+    dm_index runStart = 0;  // first block of that run
+    dm_index found = -1;
+
+    for (dm_index w = firstWord; w < endWord; w++) {
+        if (run == 0) {
+            w = bitscan_find_not_full(__free_memory, w * 8, endBlock / 8) / 8;
+            if (w >= endWord) {
+                break;
+            }
+        }
+
+        const __word_summary summary = __free_summary[w];
+        const dm_index base = w * 64;
+
+        // Free blocks at the bottom of the word extend the current run.
+        if (run + summary.prefix >= numBlocks) {
+            found = run > 0 ? runStart : base;
+            break;
+        }
+        if (summary.prefix == 64) {
+            if (run == 0) {
+                runStart = base;
+            }
+            run += 64;
+            continue;
+        }
+        if (summary.longest >= numBlocks) {
+            found = base + __run_in_word(~__load_used_word(w), numBlocks);
+            break;
+        }
+
+        // Free blocks at the top of the word start a new run.
+        run = summary.suffix;
+        runStart = base + 64 - run;
+    }
+
+    if (found < 0 || found + numBlocks > endBlock) {
+        __last_scan_length = endBlock - firstWord * 64;
+        return -1;
+    }
+
+    __set_blocks(found, numBlocks, YES);
+
+    __last_scan_length = found + numBlocks - firstWord * 64;
+    return found;
+}
+
+dm_index __first_fit (dm_index numBlocks) {
+    return __first_fit_range(numBlocks, 0, (MEMORY_SIZE + 63) / 64);
+}
+
+// Same as __first_fit_range() but starts from the end of the range and
+// returns the section closest to it, see DM_LONG_LIVED.
+//
+// Walks the word summaries downwards, carrying a run of free blocks from
+// word to word through their free prefixes.
+dm_index __last_fit_range (dm_index numBlocks, dm_index firstWord, dm_index endWord) {
+    const dm_index endBlock = endWord * 64 < MEMORY_SIZE ? endWord * 64 : MEMORY_SIZE;
+    dm_index run = 0;       // free blocks directly after the current word
+    dm_index runEnd = 0;    // block after the last one of that run
+    dm_index found = -1;
+    dm_index w = endWord - 1;
+
+    for (; w >= firstWord; w--) {
+        const __word_summary summary = __free_summary[w];
+        const dm_index base = w * 64;
+
+        // Free blocks at the top of the word extend the current run.
+        if (run + summary.suffix >= numBlocks) {
+            found = (run > 0 ? runEnd : base + 64) - numBlocks;
+            break;
+        }
+        if (summary.suffix == 64) {
+            if (run == 0) {
+                runEnd = base + 64;
+            }
+            run += 64;
+            continue;
+        }
+        if (summary.longest >= numBlocks) {
+            found = base + __last_run_in_word(~__load_used_word(w), numBlocks);
+            break;
+        }
+
+        // Free blocks at the bottom of the word start a new run.
+        run = summary.prefix;
+        runEnd = base + run;
+    }
+
+    if (found < 0) {
+        __last_scan_length = endBlock - firstWord * 64;
+        return -1;
+    }
+
+    __set_blocks(found, numBlocks, YES);
+
+    __last_scan_length = endBlock - found;
+    return found;
+}
+
+dm_index __last_fit (dm_index numBlocks) {
+    return __last_fit_range(numBlocks, 0, (MEMORY_SIZE + 63) / 64);
+}
+#endif
+
+#ifdef DM_SHARDS
+void __shard_lock (int s) {
+    while (__atomic_exchange_n(&__shards[s].lock, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(&__shards[s].lock, __ATOMIC_RELAXED)) {
+            sched_yield();
+        }
+    }
+}
+
+void __shard_unlock (int s) {
+    __atomic_store_n(&__shards[s].lock, 0, __ATOMIC_RELEASE);
+}
+
+// Returns the shard holding word w.
+int __shard_of (dm_index w) {
+    int s = (int)((long long)w * DM_SHARDS / ((MEMORY_SIZE + 63) / 64));
+    while (w < __shards[s].firstWord) {
+        --s;
+    }
+    while (w >= __shards[s].endWord) {
+        ++s;
+    }
+    return s;
+}
+
+// Allocates numBlocks blocks from shard s, which the caller holds, and
+// moves its cursor past the words that are now full.  Returns the index
+// of the first block or -1.
+dm_index __shard_fit (int s, dm_index numBlocks, int hint) {
+    __shard* shard = &__shards[s];
+    if (shard->cursor >= shard->endWord) {
+        return -1;
+    }
+    const dm_index idx = hint == DM_LONG_LIVED
+        ? __last_fit_range(numBlocks, shard->cursor, shard->endWord)
+        : __first_fit_range(numBlocks, shard->cursor, shard->endWord);
+    while (shard->cursor < shard->endWord && __free_summary[shard->cursor].longest == 0) {
+        ++shard->cursor;
+    }
+    return idx;
+}
+
+// Allocates numBlocks blocks from the home shard of the calling thread,
+// then from the other shards, then across shards, see 'Shards'.  Returns
+// the index of the first one or -1.
+dm_index __shard_alloc (dm_index numBlocks, int hint) {
+    if (__shard_home < 0) {
+        __shard_home = (int)(__atomic_fetch_add(&__shard_next, 1, __ATOMIC_RELAXED) % DM_SHARDS);
+    }
+    for (int i = 0; i < DM_SHARDS; i++) {
+        const int s = (__shard_home + i) % DM_SHARDS;
+        __shard_lock(s);
+        const dm_index idx = __shard_fit(s, numBlocks, hint);
+        __shard_unlock(s);
+        if (idx >= 0) {
+            return idx;
+        }
+    }
+
+    // Shards are always locked in order, so threads doing this can not
+    // deadlock each other.
+    for (int s = 0; s < DM_SHARDS; s++) {
+        __shard_lock(s);
+    }
+    const dm_index idx = hint == DM_LONG_LIVED ? __last_fit(numBlocks) : __first_fit(numBlocks);
+    for (int s = 0; s < DM_SHARDS; s++) {
+        while (__shards[s].cursor < __shards[s].endWord
+                && __free_summary[__shards[s].cursor].longest == 0) {
+            ++__shards[s].cursor;
+        }
+        __shard_unlock(s);
+    }
+    return idx;
+}
+
+// Frees size blocks starting at index, locking the shards they cover.
+void __shard_free (dm_index index, dm_index size) {
+    const int first = __shard_of(index / 64);
+    const int last = __shard_of((index + size - 1) / 64);
+    for (int s = first; s <= last; s++) {
+        __shard_lock(s);
+    }
+    __set_blocks(index, size, NO);
+    for (int s = first; s <= last; s++) {
+        const dm_index w = s == first ? index / 64 : __shards[s].firstWord;
+        if (w < __shards[s].cursor) {
+            __shards[s].cursor = w;
+        }
+        __shard_unlock(s);
+    }
+}
+#endif
+
+// Returns size blocks starting at index to the global bitmap.
+void __chunk_apply_free (dm_index index, dm_index size) {
+    __DM_MARK_DIRTY(&__d_memory[index], size);
+#ifdef DM_TLSF
+    tlsf_free(&__tlsf_state, index, size);
+#elif defined(DM_SHARDS)
+    __shard_free(index, size);
+#else
+    __set_blocks(index, size, NO);
+#endif
+}
+
+#ifdef DM_DEFERRED_FREE
+// Sorts the queued frees by index with a radix sort, 8 bits of the index
+// per pass, which unlike a comparison sort does not branch on the data.
+void __deferred_sort () {
+    static __deferred_free sorted [DM_DEFERRED_FREE_SIZE];
+    __deferred_free* from = __deferred_frees;
+    __deferred_free* to = sorted;
+
+    for (int shift = 0; ((unsigned long long)MEMORY_SIZE - 1) >> shift != 0; shift += 8) {
+        int counts [257] = { 0 };
+        for (int i = 0; i < __deferred_count; i++) {
+            ++counts[((from[i].index >> shift) & 0xff) + 1];
+        }
+        for (int d = 1; d < 257; d++) {
+            counts[d] += counts[d - 1];
+        }
+        for (int i = 0; i < __deferred_count; i++) {
+            to[counts[(from[i].index >> shift) & 0xff]++] = from[i];
+        }
+        __deferred_free* temp = from;
+        from = to;
+        to = temp;
+    }
+
+    if (from != __deferred_frees) {
+        memcpy(__deferred_frees, from, sizeof(__deferred_free) * __deferred_count);
+    }
+}
+
+// Applies every queued free, see 'Deferred Frees'.
+void dm_deferred_flush () {
+    __DM_LOCK();
+    if (__deferred_count == 0) {
+        __DM_UNLOCK();
+        return;
+    }
+    __deferred_sort();
+
+    dm_index start = __deferred_frees[0].index;
+    dm_index end = start + __deferred_frees[0].size;
+    for (int i = 1; i < __deferred_count; i++) {
+        const __deferred_free next = __deferred_frees[i];
+        if (next.index != end) {
+            __chunk_apply_free(start, end - start);
+            start = next.index;
+        }
+        end = next.index + next.size;
+    }
+    __chunk_apply_free(start, end - start);
+    __deferred_count = 0;
+    __DM_UNLOCK();
+}
+#endif
+
+// Allocates numBlocks blocks from the global bitmap, returns the index of
+// the first one or -1.
+//
+// Uses __first_fit(), or __last_fit() for DM_LONG_LIVED allocations,
+// unless DM_TLSF is defined, see 'TLSF Backend', or DM_SHARDS, see 'Shards'.
+dm_index __chunk_alloc (dm_index numBlocks, int hint) {
+#ifdef DM_TLSF
+    // TLSF has no notion of lifetimes.
+    (void)hint;
+    __last_scan_length = 0;
+    dm_index idx = tlsf_alloc(&__tlsf_state, numBlocks);
+#elif defined(DM_SHARDS)
+    dm_index idx = __shard_alloc(numBlocks, hint);
+#else
+    dm_index idx = hint == DM_LONG_LIVED ? __last_fit(numBlocks) : __first_fit(numBlocks);
+#endif
+#ifdef DM_DEFERRED_FREE
+    // Queued frees may be what is missing.
+    if (idx < 0 && __deferred_count > 0) {
+        dm_deferred_flush();
+        idx = __chunk_alloc(numBlocks, hint);
+    }
+#endif
+    if (idx >= 0) {
+        __DM_MARK_DIRTY(&__d_memory[idx], numBlocks);
+    }
+    return idx;
+}
+
+// Returns size blocks starting at index to the global bitmap, or queues
+// them to be returned later with DM_DEFERRED_FREE.
+void __chunk_free (dm_index index, dm_index size) {
+#ifdef DM_DEFERRED_FREE
+    if (__deferred_count == DM_DEFERRED_FREE_SIZE) {
+        dm_deferred_flush();
+    }
+    __deferred_frees[__deferred_count].index = index;
+    __deferred_frees[__deferred_count].size = size;
+    ++__deferred_count;
+#else
+    __chunk_apply_free(index, size);
+#endif
+}
+
+#ifdef DM_SLAB
+// Returns the slab class for allocations of 'size' blocks.
+int __slab_class (dm_index size) {
+    return size == 1 ? 0 : (size == 2 ? 1 : 2);
+}
+
+// Returns the position in __slabs of the slab holding block idx, -1 if
+// the block is not part of a slab.
+int __slab_find (dm_index idx) {
+    int low = 0;
+    int high = __slab_count - 1;
+    while (low <= high) {
+        const int mid = (low + high) / 2;
+        const __slab* slab = &__slabs[mid];
+        if (idx < slab->start) {
+            high = mid - 1;
+        } else if (idx >= slab->start + DM_SLAB_SLOTS * slab->slotSize) {
+            low = mid + 1;
+        } else {
+            return mid;
+        }
+    }
+    return -1;
+}
+
+// Reserves a run for a new slab of the given class and adds it to __slabs.
+// Returns its position or -1 if the table is full or d_memory ran out.
+int __slab_create (int cls) {
+    if (__slab_count == DM_SLAB_MAX) {
+        return -1;
+    }
+    const int slotSize = 1 << cls;
+    const dm_index start = __chunk_alloc(DM_SLAB_SLOTS * slotSize, DM_SHORT_LIVED);
+    if (start < 0) {
+        return -1;
+    }
+
+    // Keep the table sorted by start for __slab_find().
+    int pos = __slab_count;
+    while (pos > 0 && __slabs[pos - 1].start > start) {
+        __slabs[pos] = __slabs[pos - 1];
+        --pos;
+    }
+    __slabs[pos].start = start;
+    __slabs[pos].slotSize = slotSize;
+    __slabs[pos].occupied = 0;
+    ++__slab_count;
+
+    // Positions after pos have moved.
+    for (int i = 0; i < DM_SLAB_CLASSES; i++) {
+        __slab_current[i] = -1;
+    }
+    __slab_current[cls] = pos;
+    return pos;
+}
+
+// Returns the index of the lowest free slot of a slab with free slots.
+//
+// ~occupied has a bit set for every free slot, counting its trailing zeros
+// finds the lowest one in a single instruction (tzcnt / bsf).
+dm_index __slab_take (__slab* slab) {
+    const unsigned long long freeSlots = ~slab->occupied;
+#ifdef __GNUC__
+    const int slot = __builtin_ctzll(freeSlots);
+#else
+    int slot = 0;
+    while (!((freeSlots >> slot) & 1)) {
+        ++slot;
+    }
+#endif
+    slab->occupied |= 1ULL << slot;
+    return slab->start + slot * slab->slotSize;
+}
+
+// Allocates a slot for 'size' blocks, returns its first block or -1.
+dm_index __slab_alloc (dm_index size) {
+    const int cls = __slab_class(size);
+    const int slotSize = 1 << cls;
+
+    const int current = __slab_current[cls];
+    if (current >= 0 && ~__slabs[current].occupied != 0) {
+        return __slab_take(&__slabs[current]);
+    }
+
+    for (int i = 0; i < __slab_count; i++) {
+        if (__slabs[i].slotSize == slotSize && ~__slabs[i].occupied != 0) {
+            __slab_current[cls] = i;
+            return __slab_take(&__slabs[i]);
+        }
+    }
+
+    const int pos = __slab_create(cls);
+    return pos < 0 ? -1 : __slab_take(&__slabs[pos]);
+}
+
+// Frees the slot starting at idx if it is part of a slab and 'size' blocks
+// is what the slot was allocated for.  A free that starts inside a slot or
+// is for fewer blocks, e.g. the tail of a shrinking container, is ignored,
+// the slot stays in use until it is freed whole.
+// Returns NO if idx is not part of a slab, in which case it belongs to the
+// global bitmap.
+__bool __slab_free (dm_index idx, dm_index size) {
+    const int pos = __slab_find(idx);
+    if (pos < 0) {
+        return NO;
+    }
+
+    __slab* slab = &__slabs[pos];
+    if ((idx - slab->start) % slab->slotSize != 0 || (1 << __slab_class(size)) != slab->slotSize) {
+        return YES;
+    }
+    slab->occupied &= ~(1ULL << ((idx - slab->start) / slab->slotSize));
+
+    // Give empty slabs back, except the one currently allocated from so a
+    // single slot going back and forth does not create a slab every time.
+    const int cls = __slab_class(slab->slotSize);
+    if (slab->occupied == 0 && __slab_current[cls] != pos) {
+        __chunk_free(slab->start, DM_SLAB_SLOTS * slab->slotSize);
+        for (int i = pos; i < __slab_count - 1; i++) {
+            __slabs[i] = __slabs[i + 1];
+        }
+        --__slab_count;
+        for (int i = 0; i < DM_SLAB_CLASSES; i++) {
+            if (__slab_current[i] > pos) {
+                --__slab_current[i];
+            }
+        }
+    }
+    return YES;
+}
+#endif
+
+// Allocates numBlocks blocks from a slab or the global bitmap, returns the
+// index of the first one or -1.
+//
+// DM_LONG_LIVED allocations never go to a slab, so they do not pin slabs
+// full of short lived slots.
+dm_index __allocate (dm_index numBlocks, int hint) {
+#ifdef DM_SLAB
+    if (numBlocks <= DM_SLAB_MAX_SLOT && hint != DM_LONG_LIVED) {
+        __last_scan_length = 0;
+        const dm_index idx = __slab_alloc(numBlocks);
+        if (idx >= 0) {
+            return idx;
+        }
+    }
+#endif
+    return __chunk_alloc(numBlocks, hint);
+}
+
+// Frees size blocks starting at index to the slab or the global bitmap
+// they were allocated from.
+void __deallocate (dm_index index, dm_index size) {
+#ifdef DM_SLAB
+    if (size <= DM_SLAB_MAX_SLOT && __slab_free(index, size)) {
+        return;
+    }
+#endif
+    __chunk_free(index, size);
+}
+
+#ifdef DM_RECLAIM
+// Registers a callback to be called when an allocation fails, see 'Reclaim'.
+// Callbacks with a lower priority are called first.
+// Returns NO if DM_RECLAIM_MAX callbacks are already registered.
+__bool dm_reclaim_register (dm_reclaim_callback callback, void* context, int priority) {
+    if (__reclaimer_count == DM_RECLAIM_MAX) {
+        return NO;
+    }
+    int pos = __reclaimer_count;
+    while (pos > 0 && __reclaimers[pos - 1].priority > priority) {
+        __reclaimers[pos] = __reclaimers[pos - 1];
+        --pos;
+    }
+    __reclaimers[pos].callback = callback;
+    __reclaimers[pos].context = context;
+    __reclaimers[pos].priority = priority;
+    ++__reclaimer_count;
+    return YES;
+}
+
+// Removes a callback registered with the same context.
+void dm_reclaim_unregister (dm_reclaim_callback callback, void* context) {
+    for (int i = 0; i < __reclaimer_count; i++) {
+        if (__reclaimers[i].callback == callback && __reclaimers[i].context == context) {
+            for (int j = i; j < __reclaimer_count - 1; j++) {
+                __reclaimers[j] = __reclaimers[j + 1];
+            }
+            --__reclaimer_count;
+            return;
+        }
+    }
+}
+
+// Sets the emergency reserve aside again after it was released.
+// Returns YES if the reserve is held, NO if there is no room for it yet.
+__bool dm_reserve_restore () {
+    __DM_LOCK();
+    if (__reserve_start < 0 && DM_RESERVE_BLOCKS > 0) {
+        __reserve_start = __chunk_alloc(DM_RESERVE_BLOCKS, DM_LONG_LIVED);
+    }
+    const __bool held = __reserve_start >= 0 || DM_RESERVE_BLOCKS == 0 ? YES : NO;
+    __DM_UNLOCK();
+    return held;
+}
+
+// Returns YES if the emergency reserve has been released.
+__bool dm_reserve_released () {
+    return __reserve_start < 0 && DM_RESERVE_BLOCKS > 0 ? YES : NO;
+}
+
+// Runs the reclaim callbacks, then releases the reserve, retrying the
+// allocation after each step that freed something.  Returns the index of
+// the first block or -1.
+//
+// Allocations made by the callbacks themselves, e.g. an array moving to a
+// smaller buffer, fail normally instead of starting another reclaim.
+dm_index __reclaim_and_retry (dm_index numBlocks, int hint) {
+    if (__reclaiming) {
+        return -1;
+    }
+    __reclaiming = YES;
+
+    dm_index idx = -1;
+    for (int i = 0; i < __reclaimer_count && idx < 0; i++) {
+        if (__reclaimers[i].callback(numBlocks, __reclaimers[i].context) > 0) {
+            idx = __allocate(numBlocks, hint);
+        }
+    }
+    if (idx < 0 && __reserve_start >= 0) {
+        __chunk_free(__reserve_start, DM_RESERVE_BLOCKS);
+        __reserve_start = -1;
+        idx = __allocate(numBlocks, hint);
+    }
+
+    __reclaiming = NO;
+    return idx;
+}
+#endif
+
+#ifdef DM_THREADS
+// Gives the calling thread a cache slot if it has none and one is free.
+// Returns YES if it has one.
+__bool __thread_register () {
+    if (__thread_slot >= 0) {
+        return YES;
+    }
+    unsigned long long slots = __atomic_load_n(&__thread_slots, __ATOMIC_RELAXED);
+    while (~slots != 0) {
+        const int slot = bitscan_ctz64(~slots);
+        if (slot >= DM_MAX_THREADS) {
+            return NO;
+        }
+        if (__atomic_compare_exchange_n(&__thread_slots, &slots, slots | (1ULL << slot),
+                    NO, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            __thread_slot = slot;
+            for (int i = 0; i < DM_THREAD_CACHE_MAX; i++) {
+                __thread_cached[i] = 0;
+            }
+            return YES;
+        }
+    }
+    return NO;
+}
+
+/*
+ * Pushes the run of 'size' blocks at 'index' onto the remote free queue of
+ * slot 'owner'.
+ *
+ * The queue is a stack linked through the first block of each run.  Runs
+ * are aligned to a block, so the low 2 bits of a link are free to hold the
+ * size - 1 of the run it points to.  The owner takes the whole stack at once
+ * in __thread_drain(), so a run is never popped while being pushed and a
+ * single compare and swap is enough.
+ */
+void __thread_remote_free (int owner, dm_index index, dm_index size) {
+    block* link = (block*)((uintptr_t)&__d_memory[index] | (uintptr_t)(size - 1));
+    block* head = __atomic_load_n(&__remote_frees[owner], __ATOMIC_RELAXED);
+    do {
+        __d_memory[index] = (block)head;
+    } while (!__atomic_compare_exchange_n(&__remote_frees[owner], &head, link,
+                YES, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Moves the runs other threads freed for the calling thread into its
+// cache, the ones that do not fit go back to the arena under one lock.
+void __thread_drain () {
+    block* link = __atomic_exchange_n(&__remote_frees[__thread_slot], NULL, __ATOMIC_ACQUIRE);
+    __bool locked = NO;
+    while (link != NULL) {
+        block* start = (block*)((uintptr_t)link & ~(uintptr_t)3);
+        const dm_index size = (dm_index)((uintptr_t)link & 3) + 1;
+        const dm_index index = (dm_index)(start - __d_memory);
+        link = (block*)*start;
+
+        if (__thread_cached[size - 1] < DM_THREAD_CACHE_SIZE) {
+            __thread_cache[size - 1][__thread_cached[size - 1]++] = index;
+            continue;
+        }
+        if (!locked) {
+            __DM_LOCK();
+            locked = YES;
+        }
+        __deallocate(index, size);
+    }
+    if (locked) {
+        __DM_UNLOCK();
+    }
+}
+
+// Returns the index of a cached run of 'size' blocks or -1, see 'Threads'.
+dm_index __thread_cache_alloc (dm_index size) {
+    if (!__thread_register()) {
+        return -1;
+    }
+    if (__thread_cached[size - 1] == 0) {
+        __thread_drain();
+        if (__thread_cached[size - 1] == 0) {
+            return -1;
+        }
+    }
+    return __thread_cache[size - 1][--__thread_cached[size - 1]];
 }
 
-// Called if unable to allocate more memory.
-void __memory_error (const char* msg) {
-    printf("Memory Error: %s", msg);
-    fflush(stdout);
-    // abort code here...
+// Keeps a run of 'size' blocks that is being freed in the cache of its
+// owner.  Returns NO if it has to go back to the arena instead.
+__bool __thread_cache_free (dm_index index, dm_index size) {
+    const int owner = __thread_owner[index] - 1;
+    if (owner < 0 || !__thread_register()) {
+        return NO;
+    }
+    if (owner == __thread_slot) {
+        if (__thread_cached[size - 1] == DM_THREAD_CACHE_SIZE) {
+            return NO;
+        }
+        __thread_cache[size - 1][__thread_cached[size - 1]++] = index;
+        return YES;
+    }
+    // A slot given up in the meantime is drained by its next thread.
+    if (!(__atomic_load_n(&__thread_slots, __ATOMIC_RELAXED) & (1ULL << owner))) {
+        return NO;
+    }
+    __thread_remote_free(owner, index, size);
+    return YES;
+}
+
+// Makes the calling thread the owner of a run of 'size' blocks another
+// thread allocated and handed to it, so freeing it goes to the caller's
+// cache.  Runs larger than DM_THREAD_CACHE_MAX have no owner.
+void dm_thread_adopt (block* start, dm_index size) {
+    if (start != NULL && size <= DM_THREAD_CACHE_MAX && __thread_register()) {
+        __thread_owner[start - __d_memory] = (byte)(__thread_slot + 1);
+    }
+}
+
+// Gives the cache of the calling thread and the runs queued for it back to
+// the arena and frees its slot.  Call before the thread ends.
+void dm_thread_exit () {
+    if (__thread_slot < 0) {
+        return;
+    }
+    __thread_drain();
+    __DM_LOCK();
+    for (int i = 0; i < DM_THREAD_CACHE_MAX; i++) {
+        for (int j = 0; j < __thread_cached[i]; j++) {
+            __deallocate(__thread_cache[i][j], i + 1);
+        }
+        __thread_cached[i] = 0;
+    }
+    __DM_UNLOCK();
+    __atomic_fetch_and(&__thread_slots, ~(1ULL << __thread_slot), __ATOMIC_RELEASE);
+    __thread_slot = -1;
 }
+#endif
 
 // Looks for a section of free blocks the size of numBlocks that is all free.
 // If it is able to find a suitable section, it returns a pointer to the first element.
 // If not, it calls __memory_error() and returns NULL
-block* __find_free_chunk(int numBlocks) {
-	int additionalBlocksNeeded = numBlocks - 1;
-	for (int i = 0; i < MEMORY_SIZE; i++) {
-		if (__check_block_free(i)) {
-			// Check if blocks after are free as well.
-            __bool isOK = YES;
-			for (int j = i; j < i + additionalBlocksNeeded; j++) {
-				if (!__check_block_free(j)) {
-					i = j;
-                    isOK = NO;
-					break;
-				}
-			}
-
-            if (isOK == YES) {
-                // All needed blocks are free...
-
-                // Set blocks to be in use
-                for (int j = i; j <= i + additionalBlocksNeeded; j++) {
-                    __set_block_used(j);
-                }
-
-                // Return pointer to the first block
-                return &__d_memory[i];
-            }
-		}
-	}
+//
+// Requests of up to DM_SLAB_MAX_SLOT blocks are served from slabs when
+// DM_SLAB is defined, see 'Slabs'.  With DM_RECLAIM a failed request
+// is retried after making room, see 'Reclaim'.
+//
+// 'hint' is DM_SHORT_LIVED or DM_LONG_LIVED, see dmalloc_hint().
+//
+// With DM_THREADS small short lived requests are served from the cache of
+// the calling thread first, see 'Threads'.
+block* __find_free_chunk(dm_index numBlocks, int hint) {
+#ifdef DM_THREADS
+    if (numBlocks > 0 && numBlocks <= DM_THREAD_CACHE_MAX && hint != DM_LONG_LIVED) {
+        const dm_index cached = __thread_cache_alloc(numBlocks);
+        if (cached >= 0) {
+            return &__d_memory[cached];
+        }
+    }
+#endif
+#ifdef DM_LATENCY_HISTOGRAM
+    const unsigned long long start = __latency_start();
+#endif
+    __DM_LOCK();
+    dm_index idx = __allocate(numBlocks, hint);
+#ifdef DM_RECLAIM
+    if (idx < 0) {
+        idx = __reclaim_and_retry(numBlocks, hint);
+    }
+#endif
+#ifdef DM_THREADS
+    if (idx >= 0 && numBlocks <= DM_THREAD_CACHE_MAX) {
+        __thread_owner[idx] = hint == DM_LONG_LIVED ? EMPTY : (byte)(__thread_slot + 1);
+    }
+#endif
+
+#ifdef DM_STATS
+    __stats_record_scan();
+    if (idx < 0) {
+        ++__stats.failures;
+    }
+#endif
+#ifdef DM_EVENT_LOG
+    __event_record(idx < 0 ? DM_EVENT_FAIL : DM_EVENT_ALLOC, idx < 0 ? 0 : idx, numBlocks);
+#endif
+#ifdef DM_LATENCY_HISTOGRAM
+    __latency_record(DM_HISTOGRAM_ALLOC, start);
+    if (start != 0) {
+        __histogram_record(DM_HISTOGRAM_SCAN, __last_scan_length);
+    }
+#endif
+    __DM_UNLOCK();
+
+    if (idx >= 0) {
+        // Return pointer to the first block
+        return &__d_memory[idx];
+    }
 
 	// Unable to find a suitable chunk of memory...
 	__memory_error("Unable to allocate memory");
@@ -259,59 +2222,729 @@ block* __find_free_chunk(int numBlocks) {
 	return NULL;
 }
 
-// Finds, allocates, and returns a pointer to, a single free block.
-block* dmalloc () {
-	return __find_free_chunk(1);
-}
-
-// Finds, allocates, and returns a pointer to the
-// first element of a section of free blocks.
-block* dmalloc_array (int size) {
-	return __find_free_chunk(size);
-}
-
 // Sets the block that 'item' is pointing to to be not in use.
 //
 // Use to un-allocate a single item.
 void dmfree (block* item) {
-	int index = (int)(item - __d_memory);
-    __set_block_free(index);
+#ifdef DM_LATENCY_HISTOGRAM
+    const unsigned long long start = __latency_start();
+#endif
+	dm_index index = (dm_index)(item - __d_memory);
+#ifdef DM_THREADS
+    if (__thread_cache_free(index, 1)) {
+        return;
+    }
+#endif
+    __DM_LOCK();
+    __deallocate(index, 1);
+#ifdef DM_STATS
+    ++__stats.frees;
+#endif
+#ifdef DM_LATENCY_HISTOGRAM
+    __latency_record(DM_HISTOGRAM_FREE, start);
+#endif
+#ifdef DM_EVENT_LOG
+    __event_record(DM_EVENT_FREE, index, 1);
+#endif
+    __DM_UNLOCK();
 }
 
 // Sets a section of blocks of size 'size' after and including
 // the block that 'start' points to to be not in use.
 //
 // Use to un-allocate an entire array.
-void dmfree_array (block* start, int size) {
-	int index = (int)(start - __d_memory);
-	for (int i = index; i < size + index; i++) {
-        __set_block_free(i);
-	}
+void dmfree_array (block* start, dm_index size) {
+#ifdef DM_LATENCY_HISTOGRAM
+    const unsigned long long began = __latency_start();
+#endif
+	dm_index index = (dm_index)(start - __d_memory);
+#ifdef DM_THREADS
+    if (size > 0 && size <= DM_THREAD_CACHE_MAX && __thread_cache_free(index, size)) {
+        return;
+    }
+#endif
+    __DM_LOCK();
+    __deallocate(index, size);
+#ifdef DM_STATS
+    ++__stats.frees;
+#endif
+#ifdef DM_LATENCY_HISTOGRAM
+    __latency_record(DM_HISTOGRAM_FREE, began);
+#endif
+#ifdef DM_EVENT_LOG
+    __event_record(DM_EVENT_FREE, index, size);
+#endif
+    __DM_UNLOCK();
 }
 
-// Returns the amount of memory used as a percent.
-int amount_memory_used () {
-    int slotsFilled = 0;
-    for (int i = 0; i < MEMORY_SIZE; i++) {
-        if (!__check_block_free(i)) {
-            ++slotsFilled;
+#ifdef DM_CAPACITY_HINTS
+// Returns the capacity a container made for 'site' should start with,
+// 0 if nothing has been recorded for it, see 'Capacity Hints'.
+dm_index dm_capacity_hint (int site) {
+    return site >= 0 && site < DM_CAPACITY_SITES ? __capacity_hints[site] : 0;
+}
+
+// Records the most elements a container made for 'site' held.
+void dm_capacity_record (int site, dm_index peak) {
+    if (site < 0 || site >= DM_CAPACITY_SITES) {
+        return;
+    }
+    dm_index* hint = &__capacity_hints[site];
+    *hint = peak >= *hint ? peak : *hint - (*hint - peak + 7) / 8;
+}
+#endif
+
+#ifdef DM_COW_FORK
+static int __fork_fd = -1;          // shared memory object backing the arena
+static __bool __fork_active = NO;
+#ifdef DM_SLAB
+static __slab __fork_slabs [DM_SLAB_MAX];
+static int __fork_slab_count;
+static int __fork_slab_current [DM_SLAB_CLASSES];
+#endif
+#ifdef DM_RECLAIM
+static dm_index __fork_reserve_start;
+#endif
+
+// Moves the arena into a new shared memory object and keeps its
+// descriptor in __fork_fd.  Returns NO if that is not possible.
+__bool __fork_back_arena () {
+    char name [64];
+    snprintf(name, sizeof(name), "/d_memory.%ld.%p", (long)getpid(), (void*)&__dm_arena);
+    const int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        return NO;
+    }
+    shm_unlink(name);
+
+    void* copy = MAP_FAILED;
+    if (ftruncate(fd, sizeof(__dm_arena)) == 0) {
+        copy = mmap(NULL, sizeof(__dm_arena), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (copy == MAP_FAILED) {
+        close(fd);
+        return NO;
+    }
+    memcpy(copy, &__dm_arena, sizeof(__dm_arena));
+    munmap(copy, sizeof(__dm_arena));
+    __fork_fd = fd;
+    return YES;
+}
+
+// Starts a what-if simulation, see 'Arena Fork'.
+// Returns NO if a fork is already active or the arena could not be remapped.
+__bool dm_fork () {
+    if (__fork_active || DM_PAGE_SIZE % sysconf(_SC_PAGESIZE) != 0) {
+        return NO;
+    }
+#ifdef DM_DEFERRED_FREE
+    dm_deferred_flush();
+#endif
+    if (__fork_fd < 0 && !__fork_back_arena()) {
+        return NO;
+    }
+    if (mmap(&__dm_arena, sizeof(__dm_arena), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_FIXED, __fork_fd, 0) == MAP_FAILED) {
+        return NO;
+    }
+
+#ifdef DM_SLAB
+    memcpy(__fork_slabs, __slabs, sizeof(__slabs));
+    memcpy(__fork_slab_current, __slab_current, sizeof(__slab_current));
+    __fork_slab_count = __slab_count;
+#endif
+#ifdef DM_RECLAIM
+    __fork_reserve_start = __reserve_start;
+#endif
+    __fork_active = YES;
+    return YES;
+}
+
+// Ends the simulation started by dm_fork(), dropping every change made to
+// the arena since.
+void dm_fork_discard () {
+    if (!__fork_active) {
+        return;
+    }
+    if (mmap(&__dm_arena, sizeof(__dm_arena), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED, __fork_fd, 0) == MAP_FAILED) {
+        __memory_error("Unable to discard the arena fork");
+        return;
+    }
+
+#ifdef DM_DEFERRED_FREE
+    __deferred_count = 0;
+#endif
+#ifdef DM_SLAB
+    memcpy(__slabs, __fork_slabs, sizeof(__slabs));
+    memcpy(__slab_current, __fork_slab_current, sizeof(__slab_current));
+    __slab_count = __fork_slab_count;
+#endif
+#ifdef DM_RECLAIM
+    __reserve_start = __fork_reserve_start;
+#endif
+    __fork_active = NO;
+}
+
+// Returns YES between dm_fork() and dm_fork_discard().
+__bool dm_fork_active () {
+    return __fork_active;
+}
+#endif
+
+#ifdef DM_SHM_ARENA
+// Maps the arena of the shared memory object 'name' (e.g. "/robot") over
+// __dm_arena, creating and initializing it if this is the first process to
+// attach, see 'Shared Memory Arena'.  Call instead of initialize_memory().
+// Returns NO if the object could not be mapped or was created with another
+// MEMORY_SIZE.
+__bool dm_shm_attach (const char* name) {
+    if (__shm_fd >= 0 || DM_PAGE_SIZE % sysconf(_SC_PAGESIZE) != 0) {
+        return NO;
+    }
+    __bool created = YES;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST) {
+        created = NO;
+        fd = shm_open(name, O_RDWR, 0600);
+    }
+    if (fd < 0) {
+        return NO;
+    }
+
+    // The creator may not have sized the object yet.
+    struct stat info;
+    if (created) {
+        if (ftruncate(fd, sizeof(__dm_arena)) != 0) {
+            close(fd);
+            return NO;
+        }
+    } else {
+        while (fstat(fd, &info) == 0 && info.st_size < (off_t)sizeof(__dm_arena)) {
+            sched_yield();
         }
     }
-    return (slotsFilled * 100 / MEMORY_SIZE);
+    if (mmap(&__dm_arena, sizeof(__dm_arena), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        close(fd);
+        return NO;
+    }
+    __shm_fd = fd;
+    __shm_pid = (int)getpid();
+
+    if (created) {
+        __dm_lock();
+        __dm_arena.data.memorySize = MEMORY_SIZE;
+        initialize_memory();
+        __dm_unlock();
+        __atomic_store_n(&__dm_arena.data.ready, 1, __ATOMIC_RELEASE);
+        return YES;
+    }
+
+    while (!__atomic_load_n(&__dm_arena.data.ready, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+    if (__dm_arena.data.memorySize != (unsigned long long)MEMORY_SIZE) {
+        dm_shm_detach();
+        return NO;
+    }
+    __dm_lock();
+    __initialize_process_state();
+    __dm_unlock();
+    return YES;
+}
+
+// Unmaps the shared arena, leaving an empty private one in its place.
+// Blocks this process still holds stay allocated for the others.
+void dm_shm_detach () {
+    if (__shm_fd < 0) {
+        return;
+    }
+#ifdef DM_DEFERRED_FREE
+    dm_deferred_flush();
+#endif
+    mmap(&__dm_arena, sizeof(__dm_arena), PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    close(__shm_fd);
+    __shm_fd = -1;
+}
+
+// Removes the shared memory object 'name', the arena lives on until every
+// process detached.  Returns 0 on success as shm_unlink() does.
+int dm_shm_unlink (const char* name) {
+    return shm_unlink(name);
+}
+#endif
+
+// Returns the amount of memory used as a percent.
+//
+// Counts the used bits of __free_memory with bitscan_popcount().
+int amount_memory_used () {
+    const long long slotsFilled = bitscan_popcount(__free_memory, MEMORY_SIZE / 8);
+    return (int)(slotsFilled * 100 / MEMORY_SIZE);
 }
 
 // For testing...
 //
 // Prints out the entirety of __d_memory with the elements represented as ints.
 void print_memory () {
-	for (int i = 0; i < MEMORY_SIZE; i++) {
-		printf("block[%d]:\t0x%x\t\tfree: %d\n",
-                i,
+	for (dm_index i = 0; i < MEMORY_SIZE; i++) {
+		printf("block[%lld]:\t0x%x\t\tfree: %d\n",
+                (long long)i,
                 (int)__d_memory[i],
                 (__check_block_free(i) != 0 ? 1:0));
 	}
-    printf("Memory capacity: %d blocks\n", MEMORY_SIZE);
+    printf("Memory capacity: %lld blocks\n", (long long)MEMORY_SIZE);
     printf("Memory in use:   %d%%\n", amount_memory_used());
 }
 
+/*
+ * Event Log:
+ *
+ * When DM_EVENT_LOG is defined every allocation, failed allocation and free
+ * is recorded as a dm_event in the __event_log ring buffer.  Recording is a
+ * single atomic increment plus a 24 byte store so it may stay enabled in
+ * real runs.  Call dm_event_flush() often enough that the buffer does not
+ * wrap, events that are overwritten before a flush are counted as dropped.
+ *
+ * The file written by dm_event_flush() can be replayed against any
+ * allocator backend with dm_replay.c.
+ */
+#ifdef DM_EVENT_LOG
+
+// Appends all events recorded since the last flush to the file at 'path',
+// writing a dm_event_header first if the file is new.
+// Returns the number of events written or -1 if the file could not be opened.
+int dm_event_flush (const char* path) {
+    FILE* file = fopen(path, "ab");
+    if (file == NULL) {
+        return -1;
+    }
+
+    fseek(file, 0, SEEK_END);
+    if (ftell(file) == 0) {
+        dm_event_header header;
+        header.magic = DM_EVENT_MAGIC;
+        header.version = DM_EVENT_VERSION;
+        header.memorySize = MEMORY_SIZE;
+        header.reserved = 0;
+        fwrite(&header, sizeof(header), 1, file);
+    }
+
+    const unsigned long head = __atomic_load_n(&__event_head, __ATOMIC_ACQUIRE);
+    if (head - __event_tail > DM_EVENT_LOG_SIZE) {
+        __event_dropped += head - __event_tail - DM_EVENT_LOG_SIZE;
+        __event_tail = head - DM_EVENT_LOG_SIZE;
+    }
+
+    int written = 0;
+    for (; __event_tail < head; ++__event_tail) {
+        fwrite(&__event_log[__event_tail & (DM_EVENT_LOG_SIZE - 1)], sizeof(dm_event), 1, file);
+        ++written;
+    }
+
+    fclose(file);
+    return written;
+}
+
+// Returns the number of events overwritten before they could be flushed.
+unsigned long dm_event_dropped () {
+    return __event_dropped;
+}
+
+#endif
+
+// Checkpoint files, see 'Checkpoints' at the top of this file.
+#ifdef DM_CHECKPOINT
+
+// File offset of the latest record of every region while compacting,
+// -1 if there is none.
+static long __checkpoint_records [__DM_CHECKPOINT_REGIONS];
+
+// Returns the number of blocks in region r, only the last one may be short.
+dm_index __region_blocks (dm_index r) {
+    const dm_index left = MEMORY_SIZE - r * DM_CHECKPOINT_REGION;
+    return left < DM_CHECKPOINT_REGION ? left : DM_CHECKPOINT_REGION;
+}
+
+// Returns the number of bytes of __free_memory that cover region r.
+dm_index __region_bitmap_bytes (dm_index r) {
+    const dm_index left = MEMORY_SIZE / 8 - r * (DM_CHECKPOINT_REGION / 8);
+    return left < DM_CHECKPOINT_REGION / 8 ? left : DM_CHECKPOINT_REGION / 8;
+}
+
+// Returns the size in bytes of the record of region r, index included.
+long __region_record_size (dm_index r) {
+    return (long)(sizeof(unsigned long long) + __region_blocks(r) * sizeof(block)
+            + __region_bitmap_bytes(r));
+}
+
+// Reads the next checkpoint header of 'file'.  Returns NO at the end of
+// the file or if the header was not written by a matching program.
+__bool __checkpoint_read_header (FILE* file, dm_checkpoint_header* header) {
+    return fread(header, sizeof(*header), 1, file) == 1
+        && header->magic == DM_CHECKPOINT_MAGIC
+        && header->version == DM_CHECKPOINT_VERSION
+        && header->memorySize == (unsigned long long)MEMORY_SIZE
+        ? YES : NO;
+}
+
+// Appends a checkpoint of every region dirtied since the last one to the
+// file at 'path', or of every region if the file is new.
+// Returns the number of regions written or -1 if the file could not be written.
+int dm_checkpoint_write (const char* path) {
+#ifdef DM_DEFERRED_FREE
+    dm_deferred_flush();
+#endif
+    FILE* file = fopen(path, "ab");
+    if (file == NULL) {
+        return -1;
+    }
+    fseek(file, 0, SEEK_END);
+    const __bool full = ftell(file) == 0;
+
+    dm_checkpoint_header header;
+    header.magic = DM_CHECKPOINT_MAGIC;
+    header.version = DM_CHECKPOINT_VERSION;
+    header.memorySize = MEMORY_SIZE;
+    header.regions = 0;
+    for (dm_index r = 0; r < __DM_CHECKPOINT_REGIONS; r++) {
+        if (full || __dirty_regions[r / 8] & (1 << (r % 8))) {
+            ++header.regions;
+        }
+    }
+    fwrite(&header, sizeof(header), 1, file);
+
+    for (dm_index r = 0; r < __DM_CHECKPOINT_REGIONS; r++) {
+        if (full || __dirty_regions[r / 8] & (1 << (r % 8))) {
+            const unsigned long long index = (unsigned long long)r;
+            fwrite(&index, sizeof(index), 1, file);
+            fwrite(&__d_memory[r * DM_CHECKPOINT_REGION], sizeof(block), __region_blocks(r), file);
+            fwrite(&__free_memory[r * (DM_CHECKPOINT_REGION / 8)], 1, __region_bitmap_bytes(r), file);
+        }
+    }
+    memset(__dirty_regions, 0, sizeof(__dirty_regions));
+
+    const int failed = ferror(file);
+    fclose(file);
+    return failed ? -1 : (int)header.regions;
+}
+
+// Replaces the arena with the state saved in the file at 'path', applying
+// its checkpoints in order.
+// Returns the number of checkpoints applied or -1 if the file could not be
+// read, in which case the arena should be reinitialized.
+int dm_checkpoint_restore (const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return -1;
+    }
+
+    int applied = 0;
+    dm_checkpoint_header header;
+    while (__checkpoint_read_header(file, &header)) {
+        for (unsigned long long i = 0; i < header.regions; i++) {
+            unsigned long long index;
+            if (fread(&index, sizeof(index), 1, file) != 1 || index >= __DM_CHECKPOINT_REGIONS) {
+                fclose(file);
+                return -1;
+            }
+            const dm_index r = (dm_index)index;
+            if (fread(&__d_memory[r * DM_CHECKPOINT_REGION], sizeof(block), __region_blocks(r), file)
+                        != (size_t)__region_blocks(r)
+                    || fread(&__free_memory[r * (DM_CHECKPOINT_REGION / 8)], 1, __region_bitmap_bytes(r), file)
+                        != (size_t)__region_bitmap_bytes(r)) {
+                fclose(file);
+                return -1;
+            }
+        }
+        ++applied;
+    }
+    const __bool complete = feof(file) ? YES : NO;
+    fclose(file);
+
+    for (dm_index w = 0; w < (MEMORY_SIZE + 63) / 64; w++) {
+        __summarize_word(w);
+    }
+#ifdef DM_DEFERRED_FREE
+    __deferred_count = 0;
+#endif
+    memset(__dirty_regions, 0, sizeof(__dirty_regions));
+    return complete ? applied : -1;
+}
+
+// Merges the checkpoint chain in the file at 'path' into a single
+// checkpoint written to 'out', keeping the latest record of each region.
+// Returns the number of regions written or -1 on error.
+int dm_checkpoint_compact (const char* path, const char* out) {
+    FILE* in = fopen(path, "rb");
+    if (in == NULL) {
+        return -1;
+    }
+
+    // Find the latest record of each region.
+    for (dm_index r = 0; r < __DM_CHECKPOINT_REGIONS; r++) {
+        __checkpoint_records[r] = -1;
+    }
+    dm_checkpoint_header header;
+    while (__checkpoint_read_header(in, &header)) {
+        for (unsigned long long i = 0; i < header.regions; i++) {
+            const long at = ftell(in);
+            unsigned long long index;
+            if (fread(&index, sizeof(index), 1, in) != 1 || index >= __DM_CHECKPOINT_REGIONS) {
+                fclose(in);
+                return -1;
+            }
+            __checkpoint_records[index] = at;
+            fseek(in, __region_record_size((dm_index)index) - (long)sizeof(index), SEEK_CUR);
+        }
+    }
+
+    FILE* file = fopen(out, "wb");
+    if (file == NULL || !feof(in)) {
+        if (file != NULL) {
+            fclose(file);
+        }
+        fclose(in);
+        return -1;
+    }
+
+    header.magic = DM_CHECKPOINT_MAGIC;
+    header.version = DM_CHECKPOINT_VERSION;
+    header.memorySize = MEMORY_SIZE;
+    header.regions = 0;
+    for (dm_index r = 0; r < __DM_CHECKPOINT_REGIONS; r++) {
+        if (__checkpoint_records[r] >= 0) {
+            ++header.regions;
+        }
+    }
+    fwrite(&header, sizeof(header), 1, file);
+
+    // Records are copied as they are, a short read means a truncated chain.
+    byte record [sizeof(unsigned long long) + DM_CHECKPOINT_REGION * sizeof(block) + DM_CHECKPOINT_REGION / 8];
+    __bool failed = NO;
+    for (dm_index r = 0; r < __DM_CHECKPOINT_REGIONS && !failed; r++) {
+        if (__checkpoint_records[r] >= 0) {
+            const long size = __region_record_size(r);
+            fseek(in, __checkpoint_records[r], SEEK_SET);
+            failed = fread(record, 1, size, in) != (size_t)size;
+            fwrite(record, 1, size, file);
+        }
+    }
+
+    failed = failed || ferror(file);
+    fclose(in);
+    fclose(file);
+    return failed ? -1 : (int)header.regions;
+}
+
+#endif
+
+/*
+ * Latency Histograms:
+ *
+ * When DM_LATENCY_HISTOGRAM is defined, one in every DM_LATENCY_SAMPLE_RATE
+ * allocations and frees is timed and recorded in a log bucketed histogram
+ * kept outside of __d_memory, along with the scan length of the sampled
+ * allocations.  Times are in cycles on x86 and nanoseconds elsewhere.
+ *
+ * Buckets grow with the value so tail percentiles such as p99.9 are kept
+ * to within 1 / 2^DM_HISTOGRAM_SUB_BITS of the real value.
+ */
+#ifdef DM_LATENCY_HISTOGRAM
+
+// Returns the histogram for DM_HISTOGRAM_ALLOC, DM_HISTOGRAM_FREE
+// or DM_HISTOGRAM_SCAN.
+dm_histogram* dm_histogram_get (int which) {
+    return &__histograms[which];
+}
+
+// Returns the value below which 'percentile' percent of the recorded
+// values fall, rounded up to the end of its bucket.
+unsigned long long dm_histogram_percentile (const dm_histogram* h, double percentile) {
+    if (h->total == 0) {
+        return 0;
+    }
+
+    unsigned long long target = (unsigned long long)(percentile / 100.0 * h->total + 0.5);
+    if (target == 0) {
+        target = 1;
+    }
+
+    unsigned long long seen = 0;
+    for (int i = 0; i < DM_HISTOGRAM_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= target) {
+            const unsigned long long value = __histogram_bucket_max(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
+
+void dm_histogram_reset (dm_histogram* h) {
+    for (int i = 0; i < DM_HISTOGRAM_BUCKETS; i++) {
+        h->counts[i] = 0;
+    }
+    h->total = 0;
+    h->min = 0;
+    h->max = 0;
+}
+
+// Clears all histograms.
+void dm_histograms_reset () {
+    for (int i = 0; i < DM_HISTOGRAM_COUNT; i++) {
+        dm_histogram_reset(&__histograms[i]);
+    }
+    __latency_ops = 0;
+}
+
+// Prints count, min, p50, p99, p99.9 and max of every histogram.
+void dm_histograms_print () {
+    const char* names [DM_HISTOGRAM_COUNT] = { "dmalloc", "dmfree", "scan" };
+    printf("%-8s %10s %8s %8s %8s %8s %8s\n",
+            "op", "count", "min", "p50", "p99", "p99.9", "max");
+    for (int i = 0; i < DM_HISTOGRAM_COUNT; i++) {
+        const dm_histogram* h = &__histograms[i];
+        printf("%-8s %10llu %8llu %8llu %8llu %8llu %8llu\n",
+                names[i],
+                h->total,
+                h->min,
+                dm_histogram_percentile(h, 50.0),
+                dm_histogram_percentile(h, 99.0),
+                dm_histogram_percentile(h, 99.9),
+                h->max);
+    }
+    fflush(stdout);
+}
+
+#endif
+
+/*
+ * Tracing:
+ *
+ * When DM_TRACE is defined dmalloc, dmalloc_array, dmfree and dmfree_array
+ * are replaced by macros that record the __FILE__ and __LINE__ of every
+ * allocation.  Each block remembers which call site allocated it in
+ * __trace_owner so that frees, including the partial frees done by
+ * pop_TYPE, are credited back to the right site.
+ *
+ * dm_trace_dump() prints all sites ranked by live blocks, it is also called
+ * by __memory_error() so a failed allocation shows who owns the arena.
+ */
+#ifdef DM_TRACE
+
+// Returns the index of the site for file:line, adding it if needed.
+int __trace_find_site (const char* file, int line) {
+    for (int i = 0; i < __trace_site_count; i++) {
+        if (__trace_sites[i].line == line
+                && (__trace_sites[i].file == file || strcmp(__trace_sites[i].file, file) == 0)) {
+            return i;
+        }
+    }
+
+    if (__trace_site_count == DM_TRACE_MAX_SITES) {
+        // Table is full, "(other)" collects the rest.
+        return DM_TRACE_MAX_SITES - 1;
+    }
+    if (__trace_site_count == DM_TRACE_MAX_SITES - 1) {
+        // The last entry is only ever "(other)", so no real site is
+        // relabelled and its counts stay its own.
+        file = "(other)";
+        line = 0;
+    }
+
+    __trace_site* site = &__trace_sites[__trace_site_count];
+    site->file = file;
+    site->line = line;
+    site->liveBlocks = 0;
+    site->allocations = 0;
+    site->recentAllocations = 0;
+    site->failures = 0;
+    return __trace_site_count++;
+}
+
+block* __trace_dmalloc_array (dm_index size, int hint, const char* file, int line) {
+    const int site = __trace_find_site(file, line);
+    __trace_current_site = site;
+    block* chunk = __find_free_chunk(size, hint);
+    __trace_current_site = -1;
+
+    if (chunk == NULL) {
+        // Counted by __memory_error().
+        return NULL;
+    }
+
+    const dm_index index = (dm_index)(chunk - __d_memory);
+    for (dm_index i = index; i < index + size; i++) {
+        __trace_owner[i] = (byte)(site + 1);
+    }
+    __trace_sites[site].liveBlocks += size;
+    ++__trace_sites[site].allocations;
+    ++__trace_sites[site].recentAllocations;
+    return chunk;
+}
+
+void __trace_dmfree_array (block* start, dm_index size) {
+    const dm_index index = (dm_index)(start - __d_memory);
+    for (dm_index i = index; i < index + size; i++) {
+        if (__trace_owner[i] != EMPTY) {
+            --__trace_sites[__trace_owner[i] - 1].liveBlocks;
+            __trace_owner[i] = EMPTY;
+        }
+    }
+    dmfree_array(start, size);
+}
+
+// Prints every call site ranked by live blocks, then by allocations since
+// the previous dump.  Resets the per dump allocation counts.
+void dm_trace_dump () {
+    int order [DM_TRACE_MAX_SITES];
+    for (int i = 0; i < __trace_site_count; i++) {
+        // Insertion sort, the table is small.
+        int j = i;
+        while (j > 0) {
+            const __trace_site* a = &__trace_sites[order[j - 1]];
+            const __trace_site* b = &__trace_sites[i];
+            if (a->liveBlocks > b->liveBlocks
+                    || (a->liveBlocks == b->liveBlocks && a->recentAllocations >= b->recentAllocations)) {
+                break;
+            }
+            order[j] = order[j - 1];
+            --j;
+        }
+        order[j] = i;
+    }
+
+    printf("%-32s %8s %6s %8s %8s %8s\n",
+            "site", "live", "live%", "allocs", "recent", "failed");
+    for (int i = 0; i < __trace_site_count; i++) {
+        __trace_site* site = &__trace_sites[order[i]];
+        char name [48];
+        snprintf(name, sizeof(name), "%s:%d", site->file, site->line);
+        printf("%-32s %8lld %5d%% %8d %8d %8d\n",
+                name,
+                (long long)site->liveBlocks,
+                (int)(site->liveBlocks * 100 / MEMORY_SIZE),
+                site->allocations,
+                site->recentAllocations,
+                site->failures);
+        site->recentAllocations = 0;
+    }
+    fflush(stdout);
+}
+#endif
+
+#endif // __DM_EXTERN
+
+#ifdef DM_TRACE
+// From here on all allocations are traced.
+#define dmalloc()                   __trace_dmalloc_array(1, DM_SHORT_LIVED, __FILE__, __LINE__)
+#define dmalloc_array(size)         __trace_dmalloc_array((size), DM_SHORT_LIVED, __FILE__, __LINE__)
+#define dmalloc_hint(size, hint)    __trace_dmalloc_array((size), (hint), __FILE__, __LINE__)
+#define dmfree(item)                __trace_dmfree_array((block*)(item), 1)
+#define dmfree_array(start, size)   __trace_dmfree_array((block*)(start), (size))
+
+#endif
+
 #endif
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 
 //===---- Point ----===//
 // Point definition
@@ -91,6 +92,11 @@ void increment_location (location* currentLoc, direction heading) {
     update_location(currentLoc, heading, 1);
 }
 
+// Returns 1 if both locations have the same position and heading.
+int same_location (location a, location b) {
+    return a.position.x == b.position.x && a.position.y == b.position.y && a.heading == b.heading;
+}
+
 
 
 
@@ -99,8 +105,26 @@ void increment_location (location* currentLoc, direction heading) {
 //===---- Testing ----===//
 
 //#define MEMORY_SIZE 64
+#if defined(DM_RECLAIM) && !defined(DM_RESERVE_BLOCKS)
+// The reclaim check needs a reserve to release.
+#define DM_RESERVE_BLOCKS 8
+#endif
 #include "dmemory.h"
 
+#ifdef DM_CHECKPOINT
+// Files written by the checkpoint check, removed again at the end.
+#define CHECKPOINT_CHAIN    "line_tracker.ckpt"
+#define CHECKPOINT_COMPACT  "line_tracker_compact.ckpt"
+#endif
+
+#ifdef DM_SHM_ARENA
+#include <sys/wait.h>   // for waitpid()
+#include <unistd.h>     // for fork()
+
+// Shared memory object the arena lives in.
+#define SHM_NAME "/dm_line_tracker"
+#endif
+
 #define TYPE int
 #include "stack_dm.h"
 #include "array_dm.h"
@@ -110,13 +134,250 @@ void increment_location (location* currentLoc, direction heading) {
 #include "stack_dm.h"
 #undef TYPE
 
+#define TYPE int
+#include "pstack_dm.h"
+#undef TYPE
+
+#include "trajectory_dm.h"
+
+// Returns the number of blocks of d_memory in use.
+int blocks_in_use () {
+#ifdef DM_THREADS
+    // Cached runs count as in use, give them back first.
+    dm_thread_exit();
+#endif
+#ifdef DM_DEFERRED_FREE
+    // So do queued frees.
+    dm_deferred_flush();
+#endif
+    int used = 0;
+    for (int i = 0; i < MEMORY_SIZE; i++) {
+        used += !__check_block_free(i);
+    }
+    return used;
+}
+
+#define SHARED_ELEMENTS 6
+
+// Adopts the stack and array shared by main() and returns the number of
+// elements that differ from what was pushed and appended.
+int adopt_and_check (dm_index stackHandle, dm_index arrayHandle) {
+    stack_int stack = adopt_stack_int(stackHandle);
+    array_int array = adopt_array_int(arrayHandle);
+    int errors = (stack.size != SHARED_ELEMENTS) + (array.size != SHARED_ELEMENTS);
+    for (int i = SHARED_ELEMENTS - 1; i >= 0 && stack.size > 0; i--) {
+        errors += pop_int(&stack) != 7 * i;
+    }
+    for (int i = 0; i < SHARED_ELEMENTS && i < array.size; i++) {
+        errors += at_int(&array, i) != 11 * i;
+    }
+    delete_stack_int(&stack);
+    delete_array_int(&array);
+    return errors;
+}
+
+#if defined(DM_COW_FORK) || defined(DM_CHECKPOINT)
+// Called by exercise_arena() after each kind of change.
+typedef void (*arena_step) ();
+
+void no_step () {
+}
+
+// Changes the arena through a stack, an array, a trajectory log and a
+// persistent stack, 'round' varies what is written.  Each call leaves two
+// more elements in the stack and the array.
+void exercise_arena (stack_int* stack, array_int* array, trajectory* log, int round, arena_step step) {
+    for (int i = 0; i < 4; i++) {
+        push_int(stack, 100 * round + i);
+    }
+    step();
+    for (int i = 0; i < 4; i++) {
+        append_int(array, 100 * round + i);
+    }
+    step();
+    for (int i = 0; i < 2; i++) {
+        pop_int(stack);
+        remove_last_int(array);
+    }
+    step();
+    location loc = trajectory_at(log, log->size - 1);
+    for (int i = 0; i < 8; i++) {
+        increment_location(&loc, (round + i) % 4);
+        trajectory_append(log, loc);
+    }
+    step();
+    pstack_int base = ppush_int(make_pstack_int(), round);
+    step();
+    pstack_int top = ppush_int(base, -round);
+    delete_pstack_int(base);
+    step();
+    pstack_int other = branch_pstack_int(top);
+    step();
+    delete_pstack_int(top);
+    step();
+    delete_pstack_int(other);
+    step();
+}
+
+// Copy of the arena taken by arena_snapshot().
+static block arenaCopy [MEMORY_SIZE];
+static byte usedCopy [MEMORY_SIZE / 8];
+
+void arena_snapshot () {
+#ifdef DM_DEFERRED_FREE
+    // dm_fork() and dm_checkpoint_write() apply the queue first.
+    dm_deferred_flush();
+#endif
+    memcpy(arenaCopy, __d_memory, sizeof(arenaCopy));
+    memcpy(usedCopy, __free_memory, sizeof(usedCopy));
+}
+
+// Returns 1 if the blocks or the bitmap differ from the last snapshot.
+int arena_changed () {
+    return memcmp(arenaCopy, __d_memory, sizeof(arenaCopy)) != 0
+        || memcmp(usedCopy, __free_memory, sizeof(usedCopy)) != 0;
+}
+#endif
+
+#ifdef DM_CHECKPOINT
+static int checkpointsWritten = 0;
+static int checkpointsFailed = 0;
+
+// Appends a checkpoint to CHECKPOINT_CHAIN, then clears the arena and
+// restores it from the chain, which must bring back every block and bit.
+// Restoring after every change catches a missing dirty mark before a later
+// change dirties the same region for other reasons.
+void checkpoint_step () {
+    if (dm_checkpoint_write(CHECKPOINT_CHAIN) < 0) {
+        ++checkpointsFailed;
+        return;
+    }
+    ++checkpointsWritten;
+    arena_snapshot();
+    memset(__d_memory, 0, sizeof(arenaCopy));
+    memset(__free_memory, 0, sizeof(usedCopy));
+    if (dm_checkpoint_restore(CHECKPOINT_CHAIN) != checkpointsWritten || arena_changed()) {
+        ++checkpointsFailed;
+    }
+}
+#endif
+
+// Not with DM_TLSF, which only looks for a request in the lists whose runs
+// are all large enough, so fill_arena() can not fill every run.
+#if defined(DM_RECLAIM) && !defined(DM_TLSF)
+// A reclaim callback that records when it runs, and frees 'hoard' if set.
+typedef struct {
+    int priority;
+    block* hoard;
+    dm_index size;
+} reclaimer;
+
+static int reclaimOrder [4];
+static int reclaimCalls = 0;
+static int reclaimSawRelease = 0;   // callbacks that ran after the reserve was released
+
+dm_index record_reclaim (dm_index needed, void* context) {
+    reclaimer* r = (reclaimer*)context;
+    (void)needed;
+    if (reclaimCalls < 4) {
+        reclaimOrder[reclaimCalls] = r->priority;
+    }
+    ++reclaimCalls;
+    reclaimSawRelease += dm_reserve_released();
+    if (r->hoard == NULL) {
+        return 0;
+    }
+    dmfree_array(r->hoard, r->size);
+    r->hoard = NULL;
+    return r->size;
+}
+
+// Allocates every free run, largest first so each request fits one run
+// exactly whatever the placement.  Returns the number of runs.
+int fill_arena (block** runs, dm_index* sizes) {
+    blocks_in_use();
+    int count = 0;
+    for (int i = 0; i < MEMORY_SIZE; i++) {
+        if (__check_block_free(i) && (i == 0 || !__check_block_free(i - 1))) {
+            sizes[count++] = 1;
+        } else if (__check_block_free(i)) {
+            ++sizes[count - 1];
+        }
+    }
+    for (int i = 1; i < count; i++) {
+        for (int j = i; j > 0 && sizes[j - 1] < sizes[j]; j--) {
+            const dm_index size = sizes[j];
+            sizes[j] = sizes[j - 1];
+            sizes[j - 1] = size;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        runs[i] = dmalloc_array(sizes[i]);
+    }
+    return count;
+}
+
+// Fills the arena, then checks that the callbacks run lowest priority
+// first until one makes room, that the reserve is only released once they
+// all failed, and that dm_reserve_restore() takes it back once it is free.
+// Returns the number of errors.
+int check_reclaim () {
+    static block* runs [MEMORY_SIZE / 2];
+    static dm_index sizes [MEMORY_SIZE / 2];
+    const int usedBefore = blocks_in_use();
+    const int count = fill_arena(runs, sizes);
+    int errors = count == 0 || dm_reserve_released();
+
+    // Registered out of order, the one that makes room last.
+    reclaimer last = { 5, runs[0], sizes[0] };
+    reclaimer first = { 1, NULL, 0 };
+    reclaimer middle = { 3, NULL, 0 };
+    dm_reclaim_register(record_reclaim, &last, 5);
+    dm_reclaim_register(record_reclaim, &first, 1);
+    dm_reclaim_register(record_reclaim, &middle, 3);
+
+    block* moved = dmalloc_array(sizes[0]);
+    errors += moved == NULL || reclaimCalls != 3;
+    errors += reclaimOrder[0] != 1 || reclaimOrder[1] != 3 || reclaimOrder[2] != 5;
+    errors += reclaimSawRelease != 0 || dm_reserve_released();
+
+    // Nothing left to free, the reserve makes room after both callbacks ran.
+    dm_reclaim_unregister(record_reclaim, &last);
+    reclaimCalls = 0;
+    block* rescued = dmalloc_array(DM_RESERVE_BLOCKS);
+    errors += rescued == NULL || reclaimCalls != 2 || reclaimSawRelease != 0;
+    errors += !dm_reserve_released() || dm_reserve_restore();
+
+    dmfree_array(rescued, DM_RESERVE_BLOCKS);
+    blocks_in_use();
+    errors += !dm_reserve_restore() || dm_reserve_released();
+
+    dm_reclaim_unregister(record_reclaim, &first);
+    dm_reclaim_unregister(record_reclaim, &middle);
+    dmfree_array(moved, sizes[0]);
+    for (int i = 1; i < count; i++) {
+        dmfree_array(runs[i], sizes[i]);
+    }
+    errors += blocks_in_use() != usedBefore;
+    return errors;
+}
+#endif
+
 int main () {
     printf("d_memory size:     %d bytes\n", (int)sizeof(__d_memory));
 	printf("free check size:   %d bytes\n", (int)sizeof(__free_memory));
 	printf("total memory used: %d bytes\n\n",
             (int)sizeof(__d_memory) + (int)sizeof(__free_memory));
 
+#ifdef DM_SHM_ARENA
+    dm_shm_unlink(SHM_NAME);
+    if (!dm_shm_attach(SHM_NAME)) {
+        printf("unable to attach %s\n", SHM_NAME);
+        return 1;
+    }
+#else
     initialize_memory();
+#endif
 
     stack_int i_stack = make_stack_int();
 
@@ -138,8 +399,189 @@ int main () {
     point p = pop_point(&p_stack);
 
 //    printf("(%d, %d)\n\n", p.x, p.y);
+
+    // Persistent stack: branches share their nodes, each version reads its
+    // own values, and deleting every version frees every node.
+    // One node pushed and deleted first, so with DM_SLAB the slab the nodes
+    // come from, which stays reserved once created, is counted before.
+    delete_pstack_int(ppush_int(make_pstack_int(), 0));
+    const int usedBefore = blocks_in_use();
+    pstack_int base = ppush_int(make_pstack_int(), 1);
+    pstack_int left = ppush_int(base, 2);
+    pstack_int branch = branch_pstack_int(left);
+    pstack_int right = ppush_int(base, 3);
+    pstack_int popped = ppop_int(right);
+    delete_pstack_int(base);
+    delete_pstack_int(left);
+    delete_pstack_int(right);
+
+    pstack_int again = ppush_int(popped, 3);
+    const int values [3] = { ppeek_int(branch), ppeek_int(again), ppeek_int(popped) };
+    int pstackErrors = values[0] != 2 || values[1] != 3 || values[2] != 1;
+    pstackErrors += branch.size != 2 || again.size != 2 || popped.size != 1;
+    pstackErrors += branch.top->next != popped.top || again.top->next != popped.top;
+    delete_pstack_int(branch);
+    delete_pstack_int(again);
+    delete_pstack_int(popped);
+    const int pstackLeak = blocks_in_use() - usedBefore;
+    printf("persistent stack: %s, values %d %d %d, leak %d blocks\n\n",
+            pstackErrors == 0 && pstackLeak == 0 ? "ok" : "FAILED",
+            values[0], values[1], values[2], pstackLeak);
+
+    // Share and adopt: a stack and an array handed over by index read back
+    // the same elements, and the headers and elements are given back.  With
+    // DM_SHM_ARENA they are adopted by a child process attached to the arena.
+    const int usedBeforeShare = blocks_in_use();
+    stack_int shared = make_stack_int();
+    array_int sharedArray = make_array_int();
+    for (int i = 0; i < SHARED_ELEMENTS; i++) {
+        push_int(&shared, 7 * i);
+        append_int(&sharedArray, 11 * i);
+    }
+    const dm_index stackHandle = share_stack_int(&shared);
+    const dm_index arrayHandle = share_array_int(&sharedArray);
+    int shareErrors = stackHandle < 0 || arrayHandle < 0 || shared.size != 0 || sharedArray.size != 0;
+    if (shareErrors == 0) {
+#ifdef DM_SHM_ARENA
+        fflush(stdout);
+        const pid_t child = fork();
+        if (child == 0) {
+            dm_shm_detach();
+            const int errors = dm_shm_attach(SHM_NAME) ? adopt_and_check(stackHandle, arrayHandle) : 1;
+            dm_shm_detach();
+            _exit(errors == 0 ? 0 : 1);
+        }
+        int status = 1;
+        shareErrors += child < 0 || waitpid(child, &status, 0) != child || status != 0;
+#else
+        shareErrors += adopt_and_check(stackHandle, arrayHandle);
+#endif
+    }
+    delete_stack_int(&shared);
+    delete_array_int(&sharedArray);
+    const int shareLeak = blocks_in_use() - usedBeforeShare;
+    printf("share and adopt: %s, %d errors, leak %d blocks\n\n",
+            shareErrors == 0 && shareLeak == 0 ? "ok" : "FAILED", shareErrors, shareLeak);
+
+    // Round trip: every entry read back, in order and by index, must match
+    // what was appended.
+    #define TRAJECTORY_STEPS 200
+    location steps [TRAJECTORY_STEPS];
+    trajectory log = make_trajectory();
+    location loc = default_location();
+    for (int i = 0; i < TRAJECTORY_STEPS; i++) {
+        if (i % 10 == 0) {
+            increment_right(&loc.heading);
+        }
+        if (i % 37 == 0) {
+            // A jump off the heading, stored as a general move.
+            loc.position = add(loc.position, make_point(-3 * i, 2 * i));
+        } else {
+            increment_location(&loc, loc.heading);
+        }
+        trajectory_append(&log, loc);
+        steps[i] = loc;
+    }
+
+    int mismatches = log.size == TRAJECTORY_STEPS ? 0 : 1;
+    trajectory_cursor cursor = trajectory_begin(&log);
+    location read;
+    int count = 0;
+    while (trajectory_next(&log, &cursor, &read)) {
+        if (count >= TRAJECTORY_STEPS || !same_location(read, steps[count])) {
+            ++mismatches;
+        }
+        ++count;
+    }
+    mismatches += count != TRAJECTORY_STEPS;
+    for (int i = 0; i < TRAJECTORY_STEPS; i++) {
+        if (!same_location(trajectory_at(&log, i), steps[i])) {
+            ++mismatches;
+        }
+    }
+    if (!same_location(trajectory_at(&log, TRAJECTORY_STEPS + 5), steps[TRAJECTORY_STEPS - 1])) {
+        ++mismatches;
+    }
+    printf("trajectory round trip: %s, %d mismatches in %lld entries\n",
+            mismatches == 0 ? "ok" : "FAILED", mismatches, (long long)log.size);
+    printf("trajectory memory: %lld bytes for %lld entries\n\n",
+            trajectory_memory_used(&log), (long long)log.size);
+#if defined(DM_COW_FORK) || defined(DM_CHECKPOINT)
+    stack_int kept = make_stack_int();
+    array_int keptArray = make_array_int();
+    exercise_arena(&kept, &keptArray, &log, 1, no_step);
+#endif
+
+#ifdef DM_COW_FORK
+    // Arena fork: changes made between dm_fork() and dm_fork_discard(),
+    // through copies of the containers, leave the arena as it was.
+    arena_snapshot();
+    int forkErrors = !dm_fork();
+    if (forkErrors == 0) {
+        stack_int forkStack = kept;
+        array_int forkArray = keptArray;
+        trajectory forkLog = log;
+        exercise_arena(&forkStack, &forkArray, &forkLog, 2, no_step);
+        forkErrors += !arena_changed();
+        dm_fork_discard();
+        forkErrors += dm_fork_active() || arena_changed();
+    }
+    forkErrors += kept.size != 2 || pop_int(&kept) != 101 || pop_int(&kept) != 100;
+    printf("arena fork: %s, %d errors\n\n", forkErrors == 0 ? "ok" : "FAILED", forkErrors);
+#endif
+
+#ifdef DM_CHECKPOINT
+    // Checkpoints: a full checkpoint followed by an incremental one after
+    // each kind of change, and the chain compacted into one, both bring back
+    // the arena as it was at the last checkpoint.  A change that is not
+    // marked dirty is missing from the incremental checkpoints and leaves a
+    // stale region behind.
+    remove(CHECKPOINT_CHAIN);
+    checkpoint_step();
+    for (int round = 2; round <= 4; round++) {
+        exercise_arena(&kept, &keptArray, &log, round, checkpoint_step);
+    }
+    int checkpointErrors = checkpointsFailed;
+    checkpointErrors += dm_checkpoint_compact(CHECKPOINT_CHAIN, CHECKPOINT_COMPACT) <= 0;
+    arena_snapshot();
+    memset(__d_memory, 0, sizeof(arenaCopy));
+    memset(__free_memory, 0, sizeof(usedCopy));
+    checkpointErrors += dm_checkpoint_restore(CHECKPOINT_COMPACT) != 1 || arena_changed();
+    remove(CHECKPOINT_CHAIN);
+    remove(CHECKPOINT_COMPACT);
+    printf("checkpoint chain: %s, %d errors\n\n", checkpointErrors == 0 ? "ok" : "FAILED", checkpointErrors);
+#endif
+
+#if defined(DM_COW_FORK) || defined(DM_CHECKPOINT)
+    delete_stack_int(&kept);
+    delete_array_int(&keptArray);
+#endif
+    delete_trajectory(&log);
+
+#if defined(DM_RECLAIM) && !defined(DM_TLSF)
+    const int reclaimErrors = check_reclaim();
+    printf("reclaim: %s, order %d %d %d, %d errors\n\n", reclaimErrors == 0 ? "ok" : "FAILED",
+            reclaimOrder[0], reclaimOrder[1], reclaimOrder[2], reclaimErrors);
+#endif
+
     printf("Memory capacity: %d blocks\n", MEMORY_SIZE);
     printf("Memory in use:   %d%%\n", amount_memory_used());
 
 //	print_memory();
+#ifdef DM_SHM_ARENA
+    dm_shm_detach();
+    dm_shm_unlink(SHM_NAME);
+#endif
+    return mismatches == 0 && pstackErrors == 0 && pstackLeak == 0
+        && shareErrors == 0 && shareLeak == 0
+#ifdef DM_COW_FORK
+        && forkErrors == 0
+#endif
+#ifdef DM_CHECKPOINT
+        && checkpointErrors == 0
+#endif
+#if defined(DM_RECLAIM) && !defined(DM_TLSF)
+        && reclaimErrors == 0
+#endif
+        ? 0 : 1;
 }
@@ -0,0 +1,159 @@
+/*
+	Pseudo generic persistent stack.
+
+	A pstack_TYPE is one version of an immutable stack.  ppush and ppop
+	leave the version they are given alone and return a new one, which
+	shares every node below its top with the old one.  Each node is a few
+	blocks of d_memory holding the element, the node below it and a count
+	of the versions and nodes that point at it.
+
+	Branching a version with branch_pstack_TYPE() takes constant time, and
+	the memory used by two branches grows with the number of elements
+	they do not share rather than with their depth, which suits planners
+	that explore several futures from the same path.
+
+	Every version returned by a function below owns a reference to its
+	nodes and must be given back with delete_pstack_TYPE(), including the
+	versions ppush and ppop were called on.
+
+	With DM_THREADS the reference counts are updated atomically, so
+	versions that share nodes may be used and deleted by different threads.
+
+	Example Declaration in .c file:
+		#define TYPE point
+		#include "pstack_dm.h"
+		#undef TYPE
+
+		pstack_point base = ppush_point(make_pstack_point(), start);
+		pstack_point left = ppush_point(base, leftTurn);
+		pstack_point right = ppush_point(base, rightTurn);
+		delete_pstack_point(base);
+		...
+		delete_pstack_point(left);
+		delete_pstack_point(right);
+ */
+
+#include "dmemory.h" // for dmalloc_array() and dmfree_array()
+
+#ifdef TYPE
+
+#define TOKENPASTE(x, y) x ## y
+
+// Generic node declaration, stored in d_memory.
+#define PSNODE(T) TOKENPASTE(__pstack_node_, T)
+#define NODE PSNODE (TYPE)
+typedef struct NODE {
+    struct NODE* next;  // node below, NULL at the bottom
+    dm_index refs;      // versions and nodes pointing at this one
+    TYPE value;
+} NODE;
+
+// Number of blocks of d_memory taken by a node.
+#define NODEBLOCKS ((dm_index)((sizeof(NODE) + sizeof(block) - 1) / sizeof(block)))
+
+// Generic struct declaration.
+#define PS(T) TOKENPASTE(pstack_, T)
+#define PSTACK PS (TYPE)
+typedef struct {
+    NODE* top;  // NULL if empty
+    dm_index size;
+} PSTACK;
+
+// Generic persistent stack constructor.
+// Returns an empty version, which needs no memory.
+#define MAKEFUNCTION(T) TOKENPASTE(make_pstack_, T)
+__DM_HEADER_FUNCTION PSTACK MAKEFUNCTION (TYPE) () {
+    PSTACK stack;
+    stack.top = NULL;
+    stack.size = 0;
+    return stack;
+}
+
+// Generic branch function.
+// Returns another reference to the same version, to be deleted on its own.
+#define BRANCHFUNCTION(T) TOKENPASTE(branch_pstack_, T)
+__DM_HEADER_FUNCTION PSTACK BRANCHFUNCTION (TYPE) (PSTACK stack) {
+    if (stack.top != NULL) {
+#ifdef DM_THREADS
+        __atomic_add_fetch(&stack.top->refs, 1, __ATOMIC_RELAXED);
+#else
+        ++stack.top->refs;
+#endif
+        __DM_MARK_DIRTY(stack.top, NODEBLOCKS);
+    }
+    return stack;
+}
+
+// Generic push function.
+// Returns a new version with 'value' on top of 'stack'.  If there is no
+// room for the node it returns a branch of 'stack' instead, check size.
+#define PUSHFUNCTION(T) TOKENPASTE(ppush_, T)
+__DM_HEADER_FUNCTION PSTACK PUSHFUNCTION (TYPE) (PSTACK stack, TYPE value) {
+    NODE* node = (NODE*)dmalloc_array(NODEBLOCKS);
+    if (node == NULL) {
+        return BRANCHFUNCTION(TYPE)(stack);
+    }
+    node->next = BRANCHFUNCTION(TYPE)(stack).top;
+    node->refs = 1;
+    node->value = value;
+
+    PSTACK pushed;
+    pushed.top = node;
+    pushed.size = stack.size + 1;
+    return pushed;
+}
+
+// Generic peek function.
+// Returns the top element of a non empty version.
+#define PEEKFUNCTION(T) TOKENPASTE(ppeek_, T)
+__DM_HEADER_FUNCTION TYPE PEEKFUNCTION (TYPE) (PSTACK stack) {
+    return stack.top->value;
+}
+
+// Generic pop function.
+// Returns a new version without the top element of a non empty 'stack',
+// the element itself is read with ppeek.
+#define POPFUNCTION(T) TOKENPASTE(ppop_, T)
+__DM_HEADER_FUNCTION PSTACK POPFUNCTION (TYPE) (PSTACK stack) {
+    PSTACK popped;
+    popped.top = stack.top->next;
+    popped.size = stack.size - 1;
+    return BRANCHFUNCTION(TYPE)(popped);
+}
+
+// Gives back a version, freeing the nodes no other version uses.
+#define DELETEPSTACKFUNCTION(T) TOKENPASTE(delete_pstack_, T)
+__DM_HEADER_FUNCTION void DELETEPSTACKFUNCTION (TYPE) (PSTACK stack) {
+    NODE* node = stack.top;
+    while (node != NULL) {
+        __DM_MARK_DIRTY(node, NODEBLOCKS);
+#ifdef DM_THREADS
+        // The thread dropping the last reference frees the node, after
+        // every other thread is done with it.
+        if (__atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+            break;
+        }
+#else
+        if (--node->refs > 0) {
+            break;
+        }
+#endif
+        NODE* next = node->next;
+        dmfree_array((block*)node, NODEBLOCKS);
+        node = next;
+    }
+}
+
+// Undefine all the macros so that they may be used again.
+#undef TOKENPASTE
+#undef NODE
+#undef NODEBLOCKS
+#undef PSTACK
+#undef MAKEFUNCTION
+#undef BRANCHFUNCTION
+#undef PUSHFUNCTION
+#undef PEEKFUNCTION
+#undef POPFUNCTION
+#undef DELETEPSTACKFUNCTION
+
+#endif
@@ -14,18 +14,37 @@
 		stack_char make_stack_char()
 		void push_char(stack_char*, char)
 		char pop_char(stack_char*)
+
+	The first STACK_INLINE elements are kept inside the struct itself,
+	the stack only calls dmalloc_array() once it grows past them.
+
+	make_stack_site_TYPE(int site) makes a stack that starts at the capacity
+	recorded for 'site', see 'Capacity Hints' in dmemory.h.
+
+	Define DM_FIXED_CONTAINERS to get the fixed capacity stack of
+	stack_fixed_dm.h instead, which never allocates.
  */
 
 #include "dmemory.h" // for dmalloc_array() and dmfree_array()
 
+#ifdef DM_FIXED_CONTAINERS
+#include "stack_fixed_dm.h"
+#endif
+
 // Only define the struct and functions if a type has been defined
-#ifdef TYPE
+#if defined(TYPE) && !defined(DM_FIXED_CONTAINERS)
 
 // Default capacity for the dynamic array.
 #ifndef CAPACITY
 #define CAPACITY 8
 #endif
 
+// Number of elements stored inside the stack struct before the first
+// allocation.  Each one takes a block, as in the allocated array.
+#ifndef STACK_INLINE
+#define STACK_INLINE 4
+#endif
+
 // Macro for creating type names.
 // Will appand token y to token x.
 #define TOKENPASTE(x, y) x ## y
@@ -36,42 +55,96 @@
 #define S(T) TOKENPASTE(stack_, T)
 #define STACK S (TYPE)
 typedef struct {
-    TYPE* arr;
-    int size;
-    int capacity;
+    TYPE* arr;      // NULL while the elements are in 'local'
+    dm_index size;
+    dm_index capacity;
+    block local [STACK_INLINE > 0 ? STACK_INLINE : 1];
+#ifdef DM_CAPACITY_HINTS
+    int site;       // -1 if not made for a site
+    dm_index peak;  // most elements held so far
+#endif
 } STACK;
 
+// Returns the elements of the stack, wherever they currently are.
+#define DATAFUNCTION(T) TOKENPASTE(__stack_data_, T)
+__DM_HEADER_FUNCTION TYPE* DATAFUNCTION (TYPE) (STACK* stack) {
+    return stack->arr != NULL ? stack->arr : (TYPE*)stack->local;
+}
+
 // Generic stack constructor.
 // Retuns a premade stack object of type TYPE.
 #define MAKEFUNCTION(T) TOKENPASTE(make_stack_, T)
-STACK MAKEFUNCTION (TYPE) () {
+__DM_HEADER_FUNCTION STACK MAKEFUNCTION (TYPE) () {
     STACK stack;
-    stack.capacity = CAPACITY;
+    stack.capacity = STACK_INLINE;
     stack.size = 0;
 
-    stack.arr = (TYPE*)dmalloc_array(CAPACITY);
+    // Not pointed at 'local' as the struct is returned by value.
+    stack.arr = NULL;
+#ifdef DM_CAPACITY_HINTS
+    stack.site = -1;
+    stack.peak = 0;
+#endif
+    return stack;
+}
+
+// Generic constructor for a stack made at a known site.
+// Starts at the capacity recorded for 'site' if it does not fit 'local'.
+#define MAKESITEFUNCTION(T) TOKENPASTE(make_stack_site_, T)
+__DM_HEADER_FUNCTION STACK MAKESITEFUNCTION (TYPE) (int site) {
+    STACK stack = MAKEFUNCTION(TYPE)();
+#ifdef DM_CAPACITY_HINTS
+    stack.site = site;
+    const dm_index c = dm_capacity_hint(site);
+    if (c > stack.capacity) {
+        stack.arr = (TYPE*)dmalloc_array(c);
+        if (stack.arr != NULL) {
+            stack.capacity = c;
+        }
+    }
+#else
+    (void)site;
+#endif
     return stack;
 }
 
 // void push_TYPE (stack_TYPE*, TYPE);
 // Generic push function.
 // Appends an item of type TYPE to the given stack.
-// Will expand the underlying array if needed.
+// Will expand the underlying array if needed.  If there is no room to
+// expand it, the error is reported by __memory_error() and the stack is
+// left as it was, without the item.
 #define PUSHFUNCTION(T) TOKENPASTE(push_, T)
-void PUSHFUNCTION (TYPE) (STACK* stack, TYPE value) {
+__DM_HEADER_FUNCTION void PUSHFUNCTION (TYPE) (STACK* stack, TYPE value) {
     if (stack->size == stack->capacity) {
-        const int c = (CAPACITY / 2) + stack->capacity;
+        // Moving out of 'local' goes straight to the default capacity.
+        const dm_index c = stack->arr == NULL && stack->capacity < CAPACITY
+            ? CAPACITY
+            : (CAPACITY / 2) + stack->capacity;
+        TYPE* oldArray = DATAFUNCTION(TYPE)(stack);
         TYPE* newArray = (TYPE*) dmalloc_array(c);
-        for (int i = 0; i < stack->size; i++) {
-            newArray[TYPECOEF * i] = stack->arr[TYPECOEF * i];
+        if (newArray == NULL) {
+            return;
+        }
+        for (dm_index i = 0; i < stack->size; i++) {
+            newArray[TYPECOEF * i] = oldArray[TYPECOEF * i];
+        }
+        if (stack->arr != NULL) {
+            dmfree_array((block*)stack->arr, stack->capacity);
         }
-        dmfree_array((block*)stack->arr, stack->capacity);
         stack->arr = newArray;
         stack->capacity = c;
     }
 
-    stack->arr[TYPECOEF * stack->size] = value;
+    TYPE* slot = &DATAFUNCTION(TYPE)(stack)[TYPECOEF * stack->size];
+    *slot = value;
+    __DM_MARK_DIRTY(slot, 1);
     ++stack->size;
+#ifdef DM_CAPACITY_HINTS
+    if (stack->size > stack->peak) {
+        stack->peak = stack->size;
+    }
+#endif
 }
 
 // TYPE pop_TYPE (stack_TYPE*);
@@ -79,26 +152,85 @@ void PUSHFUNCTION (TYPE) (STACK* stack, TYPE value) {
 // Returns the last element of the underling array and decrements
 // will un-allocate some memory if size is small enough.
 #define POPFUNCTION(T) TOKENPASTE(pop_, T)
-TYPE POPFUNCTION (TYPE) (STACK* stack) {
+__DM_HEADER_FUNCTION TYPE POPFUNCTION (TYPE) (STACK* stack) {
     --stack->size;
-    if (stack->capacity > CAPACITY && stack->size < stack->capacity / 2) {
-        dmfree_array((block*)&stack->arr[TYPECOEF * (stack->capacity / 2)], stack->capacity / 2);
-        stack->capacity = stack->capacity / 2;
+    if (stack->arr != NULL && stack->capacity > CAPACITY && stack->size < stack->capacity / 2
+#ifdef DM_SLAB
+            // Slab slots can only be freed whole.
+            && stack->capacity > DM_SLAB_MAX_SLOT
+#endif
+            ) {
+        // Frees the odd block as well when the capacity is odd.
+        const dm_index c = stack->capacity / 2;
+        dmfree_array((block*)&stack->arr[TYPECOEF * c], stack->capacity - c);
+        stack->capacity = c;
     }
-    return stack->arr[TYPECOEF * stack->size];
+    return DATAFUNCTION(TYPE)(stack)[TYPECOEF * stack->size];
+}
+
+// Generic share function.
+// Swaps the stack for a header in d_memory that another process or file
+// takes over with adopt_stack_TYPE(), see 'Shared Memory Arena' in
+// dmemory.h.  The elements are not copied, unless they are still in
+// 'local'.  Returns the index of the header and leaves the stack empty,
+// or returns -1 and leaves it as it was if there is no room.
+#define SHAREFUNCTION(T) TOKENPASTE(share_stack_, T)
+__DM_HEADER_FUNCTION dm_index SHAREFUNCTION (TYPE) (STACK* stack) {
+    TYPE* data = stack->arr;
+    dm_index c = stack->capacity;
+    if (data == NULL) {
+        c = c < CAPACITY ? CAPACITY : c;
+        data = (TYPE*)dmalloc_array(c);
+        if (data == NULL) {
+            return -1;
+        }
+        for (dm_index i = 0; i < stack->size; i++) {
+            data[TYPECOEF * i] = ((TYPE*)stack->local)[TYPECOEF * i];
+        }
+    }
+
+    const dm_index handle = __handoff_store(stack->size, c, data);
+    if (handle < 0) {
+        if (stack->arr == NULL) {
+            dmfree_array((block*)data, c);
+        }
+        return -1;
+    }
+    *stack = MAKEFUNCTION(TYPE)();
+    return handle;
+}
+
+// Generic adopt function.
+// Returns the stack left by share_stack_TYPE() at 'handle'.
+#define ADOPTFUNCTION(T) TOKENPASTE(adopt_stack_, T)
+__DM_HEADER_FUNCTION STACK ADOPTFUNCTION (TYPE) (dm_index handle) {
+    STACK stack = MAKEFUNCTION(TYPE)();
+    stack.arr = (TYPE*)__handoff_take(handle, &stack.size, &stack.capacity);
+    return stack;
 }
 
 // Un-allocate a stack freeing up all memory currently used by it.
 #define DELETESTACKFUNCTION(T) TOKENPASTE(delete_stack_, T)
-void DELETESTACKFUNCTION (TYPE) (STACK* stack) {
-    dmfree_array((block*)stack->arr, stack->capacity);
+__DM_HEADER_FUNCTION void DELETESTACKFUNCTION (TYPE) (STACK* stack) {
+#ifdef DM_CAPACITY_HINTS
+    if (stack->site >= 0) {
+        dm_capacity_record(stack->site, stack->peak);
+    }
+#endif
+    if (stack->arr != NULL) {
+        dmfree_array((block*)stack->arr, stack->capacity);
+    }
 }
 
 // Undefine all the macros so that they may be used again.
 #undef TOKENPASTE
+#undef DATAFUNCTION
 #undef MAKEFUNCTION
+#undef MAKESITEFUNCTION
 #undef PUSHFUNCTION
 #undef POPFUNCTION
+#undef SHAREFUNCTION
+#undef ADOPTFUNCTION
 #undef DELETESTACKFUNCTION
 #undef STACK
 
@@ -0,0 +1,150 @@
+/*
+	Fixed capacity stack, the bounded twin of stack_dm.h.
+
+	Declares the same stack_TYPE struct and functions as stack_dm.h, but
+	the elements live in an array of CAPACITY elements inside the struct.
+	Only share and adopt call into d_memory and push and pop take constant
+	time, so the stack may be used where an allocation can not be afforded.
+
+	Defining DM_FIXED_CONTAINERS before including stack_dm.h switches it to
+	this file, so a program can move between growable and bounded stacks
+	with a single define.  Or include it directly:
+		#define TYPE char
+		#define CAPACITY 32
+		#include "stack_fixed_dm.h"
+		#undef CAPACITY
+		#undef TYPE
+
+	Pushing onto a full stack calls __memory_error() and drops the value,
+	check size against capacity first where that matters.
+ */
+
+#include "dmemory.h" // for dm_index, __DM_HEADER_FUNCTION and the handoff header
+
+#ifdef TYPE
+
+// Number of elements the stack holds.
+#ifndef CAPACITY
+#define CAPACITY 8
+#endif
+
+#define TOKENPASTE(x, y) x ## y
+
+// Generic struct declaration.
+#define S(T) TOKENPASTE(stack_, T)
+#define STACK S (TYPE)
+typedef struct {
+    TYPE arr [CAPACITY];
+    dm_index size;
+    dm_index capacity; // always CAPACITY
+} STACK;
+
+// Generic stack constructor.
+// Retuns an empty stack object of type TYPE.
+#define MAKEFUNCTION(T) TOKENPASTE(make_stack_, T)
+__DM_HEADER_FUNCTION STACK MAKEFUNCTION (TYPE) () {
+    STACK stack;
+    stack.capacity = CAPACITY;
+    stack.size = 0;
+    return stack;
+}
+
+// Same as make_stack_TYPE(), the capacity is fixed whatever the site.
+#define MAKESITEFUNCTION(T) TOKENPASTE(make_stack_site_, T)
+__DM_HEADER_FUNCTION STACK MAKESITEFUNCTION (TYPE) (int site) {
+    (void)site;
+    return MAKEFUNCTION(TYPE)();
+}
+
+// void push_TYPE (stack_TYPE*, TYPE);
+// Generic push function.
+// Appends an item of type TYPE to the given stack.  A full stack calls
+// __memory_error() and drops the item, as the growable stack does when it
+// can not grow.
+#define PUSHFUNCTION(T) TOKENPASTE(push_, T)
+__DM_HEADER_FUNCTION void PUSHFUNCTION (TYPE) (STACK* stack, TYPE value) {
+    if (stack->size == CAPACITY) {
+        __memory_error("Stack is full\n");
+        return;
+    }
+    stack->arr[stack->size] = value;
+    ++stack->size;
+}
+
+// TYPE pop_TYPE (stack_TYPE*);
+// Generic pop function.
+// Removes and returns the last element of the stack.
+#define POPFUNCTION(T) TOKENPASTE(pop_, T)
+__DM_HEADER_FUNCTION TYPE POPFUNCTION (TYPE) (STACK* stack) {
+    --stack->size;
+    return stack->arr[stack->size];
+}
+
+// Blocks of d_memory taken by each element when shared.
+#define ELEMENTBLOCKS ((dm_index)((sizeof(TYPE) + sizeof(block) - 1) / sizeof(block)))
+
+// Generic share function.
+// Copies the elements into d_memory under a handoff header that another
+// process or file takes over with adopt_stack_TYPE(), see 'Shared Memory
+// Arena' in dmemory.h.  Unlike the growable stack the elements are copied,
+// they live in the struct.  Returns the index of the header and leaves the
+// stack empty, or returns -1 and leaves it as it was if there is no room.
+//
+// Each element starts a block of its own, the layout of stack_dm.h, so for
+// types of up to a block a handle shared by either kind of stack can be
+// adopted by the other.
+#define SHAREFUNCTION(T) TOKENPASTE(share_stack_, T)
+__DM_HEADER_FUNCTION dm_index SHAREFUNCTION (TYPE) (STACK* stack) {
+    const dm_index capacity = stack->size > 0 ? stack->size : 1;
+    block* data = dmalloc_array(capacity * ELEMENTBLOCKS);
+    if (data == NULL) {
+        return -1;
+    }
+    for (dm_index i = 0; i < stack->size; i++) {
+        memcpy(&data[i * ELEMENTBLOCKS], &stack->arr[i], sizeof(TYPE));
+    }
+    const dm_index handle = __handoff_store(stack->size, capacity, data);
+    if (handle < 0) {
+        dmfree_array(data, capacity * ELEMENTBLOCKS);
+        return -1;
+    }
+    stack->size = 0;
+    return handle;
+}
+
+// Generic adopt function.
+// Returns the stack left by share_stack_TYPE() at 'handle', keeping at
+// most CAPACITY elements, and frees the copy in d_memory.
+#define ADOPTFUNCTION(T) TOKENPASTE(adopt_stack_, T)
+__DM_HEADER_FUNCTION STACK ADOPTFUNCTION (TYPE) (dm_index handle) {
+    STACK stack = MAKEFUNCTION(TYPE)();
+    dm_index size;
+    dm_index capacity;
+    block* data = __handoff_take(handle, &size, &capacity);
+    stack.size = size < CAPACITY ? size : CAPACITY;
+    for (dm_index i = 0; i < stack.size; i++) {
+        memcpy(&stack.arr[i], &data[i * ELEMENTBLOCKS], sizeof(TYPE));
+    }
+    dmfree_array(data, capacity * ELEMENTBLOCKS);
+    return stack;
+}
+
+// Empties the stack, there is no memory to give back.
+#define DELETESTACKFUNCTION(T) TOKENPASTE(delete_stack_, T)
+__DM_HEADER_FUNCTION void DELETESTACKFUNCTION (TYPE) (STACK* stack) {
+    stack->size = 0;
+}
+
+// Undefine all the macros so that they may be used again.
+#undef TOKENPASTE
+#undef MAKEFUNCTION
+#undef MAKESITEFUNCTION
+#undef PUSHFUNCTION
+#undef POPFUNCTION
+#undef ELEMENTBLOCKS
+#undef SHAREFUNCTION
+#undef ADOPTFUNCTION
+#undef DELETESTACKFUNCTION
+#undef STACK
+
+#endif
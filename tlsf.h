@@ -0,0 +1,269 @@
+/*
+ * Two Level Segregated Fit allocator (TLSF for short).
+ *
+ * Reference implementation used to compare against, and as an optional
+ * backend of, the d_memory allocator.  Allocates runs of blocks out of a
+ * region of 'capacity' blocks in constant time regardless of how full or
+ * fragmented the region is.
+ *
+ * Free runs are kept in segregated lists.  A size is mapped to a first level
+ * index, the position of its highest set bit, and a second level index, the
+ * TLSF_SL_BITS bits below it:
+ *
+ *      size = 100 = bx1100100, TLSF_SL_BITS = 4
+ *                     ^^^^^ highest bit is 6, next 4 bits are 1001
+ *      fl = 6 - 4 + 1 = 3, sl = 9
+ *
+ * One bit per first level index in fl_bitmap and one bit per second level
+ * list in sl_bitmap[fl] records which lists are non empty, so a list that is
+ * guaranteed to fit a request is found with two find-first-set operations.
+ *
+ * Everything is index based (in blocks from the start of the region) and
+ * the bookkeeping lives in caller provided arrays outside the region, so
+ * the region itself holds nothing but user data:
+ *
+ *      used    bitmap, 1 bit per block, set if the block is in use
+ *              (same layout as __free_memory so it may be shared with it)
+ *      tag     at the first block of a free run:  its size
+ *              at the last block of a free run:   -(first block + 1),
+ *                                                 unless the run is 1 block
+ *      next    next free run in the same list, -1 if none
+ *      prev    previous free run in the same list, -1 if none
+ *
+ * Free runs are coalesced with their physical neighbours as soon as they
+ * are freed.  As tlsf_free() is given the size of the run, allocated runs
+ * carry no header and may be freed in parts.
+ */
+
+#ifndef __tlsf_h__
+#define __tlsf_h__
+
+// Number of second level lists per first level index, as a power of 2.
+#ifndef TLSF_SL_BITS
+#define TLSF_SL_BITS 4
+#endif
+
+#define TLSF_SL_COUNT (1 << TLSF_SL_BITS)
+#define TLSF_FL_COUNT (32 - TLSF_SL_BITS + 1)
+
+#define TLSF_NONE -1
+
+typedef struct {
+    unsigned int flBitmap;
+    unsigned int slBitmap [TLSF_FL_COUNT];
+    int heads [TLSF_FL_COUNT][TLSF_SL_COUNT];
+
+    unsigned char* used;
+    int* tag;
+    int* next;
+    int* prev;
+    int capacity;
+} tlsf;
+
+// Returns the position of the highest set bit of a non zero value.
+int __tlsf_msb (unsigned int value) {
+#ifdef __GNUC__
+    return 31 - __builtin_clz(value);
+#else
+    int bit = 0;
+    while (value >>= 1) {
+        ++bit;
+    }
+    return bit;
+#endif
+}
+
+// Returns the position of the lowest set bit of a non zero value.
+int __tlsf_lsb (unsigned int value) {
+#ifdef __GNUC__
+    return __builtin_ctz(value);
+#else
+    int bit = 0;
+    while (!(value & 1)) {
+        value >>= 1;
+        ++bit;
+    }
+    return bit;
+#endif
+}
+
+// Returns the list a free run of 'size' blocks belongs in.
+void __tlsf_mapping_insert (int size, int* fl, int* sl) {
+    if (size < TLSF_SL_COUNT) {
+        *fl = 0;
+        *sl = size;
+    } else {
+        const int msb = __tlsf_msb((unsigned int)size);
+        *fl = msb - TLSF_SL_BITS + 1;
+        *sl = (size >> (msb - TLSF_SL_BITS)) ^ TLSF_SL_COUNT;
+    }
+}
+
+// Returns the first list in which every run is at least 'size' blocks.
+void __tlsf_mapping_search (int size, int* fl, int* sl) {
+    if (size >= TLSF_SL_COUNT) {
+        size += (1 << (__tlsf_msb((unsigned int)size) - TLSF_SL_BITS)) - 1;
+    }
+    __tlsf_mapping_insert(size, fl, sl);
+}
+
+// Sets or clears the used bits of blocks [start, start + size).
+void __tlsf_mark (tlsf* t, int start, int size, unsigned char used) {
+    int i = start;
+    const int end = start + size;
+    // Leading bits up to a byte boundary, whole bytes, then trailing bits.
+    for (; i < end && i % 8 != 0; i++) {
+        if (used) t->used[i / 8] |= (unsigned char)(1 << (i % 8));
+        else      t->used[i / 8] &= (unsigned char)~(1 << (i % 8));
+    }
+    for (; i + 8 <= end; i += 8) {
+        t->used[i / 8] = used ? 0xff : 0x00;
+    }
+    for (; i < end; i++) {
+        if (used) t->used[i / 8] |= (unsigned char)(1 << (i % 8));
+        else      t->used[i / 8] &= (unsigned char)~(1 << (i % 8));
+    }
+}
+
+int __tlsf_is_used (tlsf* t, int idx) {
+    return t->used[idx / 8] & (1 << (idx % 8));
+}
+
+// Adds the free run [start, start + size) to its list.
+void __tlsf_insert (tlsf* t, int start, int size) {
+    int fl, sl;
+    __tlsf_mapping_insert(size, &fl, &sl);
+
+    t->tag[start] = size;
+    if (size > 1) {
+        t->tag[start + size - 1] = -(start + 1);
+    }
+
+    const int head = t->heads[fl][sl];
+    t->next[start] = head;
+    t->prev[start] = TLSF_NONE;
+    if (head != TLSF_NONE) {
+        t->prev[head] = start;
+    }
+    t->heads[fl][sl] = start;
+    t->flBitmap |= 1u << fl;
+    t->slBitmap[fl] |= 1u << sl;
+}
+
+// Removes the free run starting at 'start' from its list.
+void __tlsf_remove (tlsf* t, int start) {
+    int fl, sl;
+    __tlsf_mapping_insert(t->tag[start], &fl, &sl);
+
+    const int next = t->next[start];
+    const int prev = t->prev[start];
+    if (next != TLSF_NONE) {
+        t->prev[next] = prev;
+    }
+    if (prev != TLSF_NONE) {
+        t->next[prev] = next;
+    } else {
+        t->heads[fl][sl] = next;
+        if (next == TLSF_NONE) {
+            t->slBitmap[fl] &= ~(1u << sl);
+            if (t->slBitmap[fl] == 0) {
+                t->flBitmap &= ~(1u << fl);
+            }
+        }
+    }
+}
+
+// Sets up an allocator over a region of 'capacity' blocks, all of them free.
+//
+// 'used' must hold capacity / 8 bytes (rounded up), 'tag', 'next' and
+// 'prev' capacity ints each.
+void tlsf_init (tlsf* t, int capacity, unsigned char* used, int* tag, int* next, int* prev) {
+    t->flBitmap = 0;
+    for (int fl = 0; fl < TLSF_FL_COUNT; fl++) {
+        t->slBitmap[fl] = 0;
+        for (int sl = 0; sl < TLSF_SL_COUNT; sl++) {
+            t->heads[fl][sl] = TLSF_NONE;
+        }
+    }
+
+    t->used = used;
+    t->tag = tag;
+    t->next = next;
+    t->prev = prev;
+    t->capacity = capacity;
+
+    __tlsf_mark(t, 0, capacity, 0);
+    if (capacity > 0) {
+        __tlsf_insert(t, 0, capacity);
+    }
+}
+
+// Allocates a run of 'size' blocks.
+// Returns the index of its first block or TLSF_NONE if no free run is
+// large enough.
+int tlsf_alloc (tlsf* t, int size) {
+    if (size <= 0 || size > t->capacity) {
+        return TLSF_NONE;
+    }
+
+    int fl, sl;
+    __tlsf_mapping_search(size, &fl, &sl);
+    if (fl >= TLSF_FL_COUNT) {
+        return TLSF_NONE;
+    }
+
+    // Non empty list in the same first level at or above sl, otherwise the
+    // first non empty list of a larger first level.
+    unsigned int slMap = t->slBitmap[fl] & (~0u << sl);
+    if (slMap == 0) {
+        const unsigned int flMap = fl + 1 < 32 ? t->flBitmap & (~0u << (fl + 1)) : 0;
+        if (flMap == 0) {
+            return TLSF_NONE;
+        }
+        fl = __tlsf_lsb(flMap);
+        slMap = t->slBitmap[fl];
+    }
+    sl = __tlsf_lsb(slMap);
+
+    const int start = t->heads[fl][sl];
+    const int runSize = t->tag[start];
+    __tlsf_remove(t, start);
+
+    // Give the remainder back.
+    if (runSize > size) {
+        __tlsf_insert(t, start + size, runSize - size);
+    }
+
+    __tlsf_mark(t, start, size, 1);
+    return start;
+}
+
+// Frees the blocks [start, start + size), merging them with any free run
+// directly before or after.
+void tlsf_free (tlsf* t, int start, int size) {
+    __tlsf_mark(t, start, size, 0);
+
+    if (start > 0 && !__tlsf_is_used(t, start - 1)) {
+        const int tag = t->tag[start - 1];
+        const int before = tag < 0 ? -tag - 1 : start - 1;
+        size += t->tag[before];
+        start = before;
+        __tlsf_remove(t, before);
+    }
+
+    const int after = start + size;
+    if (after < t->capacity && !__tlsf_is_used(t, after)) {
+        size += t->tag[after];
+        __tlsf_remove(t, after);
+    }
+
+    __tlsf_insert(t, start, size);
+}
+
+// Returns the number of bytes of bookkeeping kept for a region of
+// 'capacity' blocks, not counting the region itself.
+long tlsf_overhead (int capacity) {
+    return (long)sizeof(tlsf) + (capacity + 7) / 8 + 3L * capacity * (long)sizeof(int);
+}
+
+#endif
@@ -0,0 +1,357 @@
+/*
+ * Compressed trajectory log.
+ *
+ * Storing a full location struct for every step costs 12 bytes (or two
+ * 8 byte blocks once it is placed in d_memory).  Consecutive locations of
+ * a robot are almost always a short move along its current heading, so
+ * the trajectory log stores each step as a delta from the previous one:
+ *
+ *  Entry layout:
+ *      header byte:
+ *          bits 0-1    heading code (NORTH, EAST, SOUTH or WEST)
+ *          bit  2      axis flag, set if the move lies along the heading
+ *          bits 3-7    inline zigzag distance + 1, or 0 if a varint follows
+ *
+ *      axis move:      distance along the heading as a zigzag varint
+ *                      (omitted if it fit inline in the header)
+ *      general move:   dx and dy as zigzag varints
+ *
+ * A typical one unit step is therefore stored in a single byte.
+ *
+ * Bytes are appended to a chain of segments allocated with dmalloc_array().
+ * The first block of each segment points to the next segment, the rest of
+ * the segment holds entry bytes.
+ *
+ * Every TRAJECTORY_KEYFRAME_INTERVAL entries a keyframe is written.  A
+ * keyframe is a general move encoded relative to (0, 0) so it can be decoded
+ * without any of the entries before it.  The position of every keyframe is
+ * kept in a small index so trajectory_at() only has to decode at most
+ * TRAJECTORY_KEYFRAME_INTERVAL entries.
+ *
+ * Example Declaration in .c file:
+ *      (point, direction and location must already be defined)
+ *      #include "trajectory_dm.h"
+ *
+ *      trajectory log = make_trajectory();
+ *      trajectory_append(&log, currentLoc);
+ */
+
+#ifndef __trajectory_dm_h__
+#define __trajectory_dm_h__
+
+#include "dmemory.h" // for dmalloc_array() and dmfree_array()
+
+// Size of each segment in blocks, the first block is used as the link.
+#ifndef TRAJECTORY_SEGMENT_BLOCKS
+#define TRAJECTORY_SEGMENT_BLOCKS 16
+#endif
+
+// Number of entries between keyframes.
+#ifndef TRAJECTORY_KEYFRAME_INTERVAL
+#define TRAJECTORY_KEYFRAME_INTERVAL 64
+#endif
+
+// Number of entry bytes that fit in a single segment.
+#define __TRAJECTORY_SEGMENT_BYTES ((TRAJECTORY_SEGMENT_BLOCKS - 1) * sizeof(block))
+
+#define __TRAJECTORY_AXIS_FLAG  0x04
+#define __TRAJECTORY_INLINE_MAX 31
+
+typedef struct {
+    block* head;            // first segment
+    block* tail;            // segment currently being appended to
+    int tailUsed;           // bytes used in the tail segment
+
+    block* keyframes;       // index, two blocks per keyframe: segment, offset
+    dm_index keyframeCapacity; // in keyframes
+
+    dm_index size;          // number of entries
+    dm_index segments;      // number of segments in the chain
+    location last;          // last appended location
+} trajectory;
+
+// Read position used to decode a trajectory sequentially.
+typedef struct {
+    block* segment;
+    int offset;
+    dm_index index;
+    location current;
+} trajectory_cursor;
+
+// Returns a pointer to the first entry byte of a segment.
+__DM_HEADER_FUNCTION byte* __trajectory_data (block* segment) {
+    return (byte*)(segment + 1);
+}
+
+// Zigzag encoding maps signed values to unsigned ones so that small
+// negative numbers also get a short varint.
+//      0 -> 0, -1 -> 1, 1 -> 2, -2 -> 3, ...
+__DM_HEADER_FUNCTION unsigned int __zigzag_encode (int value) {
+    return ((unsigned int)value << 1) ^ (unsigned int)(value >> 31);
+}
+
+__DM_HEADER_FUNCTION int __zigzag_decode (unsigned int value) {
+    return (int)(value >> 1) ^ -(int)(value & 1);
+}
+
+// Constructs an empty trajectory log, no memory is allocated until the
+// first entry is appended.
+__DM_HEADER_FUNCTION trajectory make_trajectory () {
+    trajectory log;
+    log.head = NULL;
+    log.tail = NULL;
+    log.tailUsed = 0;
+    log.keyframes = NULL;
+    log.keyframeCapacity = 0;
+    log.size = 0;
+    log.segments = 0;
+    log.last.position = make_point(0, 0);
+    log.last.heading = NORTH;
+    return log;
+}
+
+// Makes sure that there is room for at least one more byte in the tail
+// segment, linking a new segment onto the chain if needed.
+__DM_HEADER_FUNCTION __bool __trajectory_reserve (trajectory* log) {
+    if (log->tail != NULL && log->tailUsed < (int)__TRAJECTORY_SEGMENT_BYTES) {
+        return YES;
+    }
+
+    block* segment = dmalloc_array(TRAJECTORY_SEGMENT_BLOCKS);
+    if (segment == NULL) {
+        return NO;
+    }
+    segment[0] = NULL;
+
+    if (log->tail == NULL) {
+        log->head = segment;
+    } else {
+        log->tail[0] = (block)segment;
+        __DM_MARK_DIRTY(log->tail, 1);
+    }
+    log->tail = segment;
+    log->tailUsed = 0;
+    ++log->segments;
+    return YES;
+}
+
+// Appends a single byte to the log.
+__DM_HEADER_FUNCTION __bool __trajectory_put (trajectory* log, byte value) {
+    if (!__trajectory_reserve(log)) {
+        return NO;
+    }
+    __trajectory_data(log->tail)[log->tailUsed] = value;
+    __DM_MARK_DIRTY(&__trajectory_data(log->tail)[log->tailUsed], 1);
+    ++log->tailUsed;
+    return YES;
+}
+
+// Appends an unsigned value 7 bits at a time, the high bit of each byte
+// is set if more bytes follow.
+__DM_HEADER_FUNCTION __bool __trajectory_put_varint (trajectory* log, unsigned int value) {
+    while (value >= 0x80) {
+        if (!__trajectory_put(log, (byte)(value | 0x80))) {
+            return NO;
+        }
+        value >>= 7;
+    }
+    return __trajectory_put(log, (byte)value);
+}
+
+// Records the current write position in the keyframe index.
+__DM_HEADER_FUNCTION __bool __trajectory_add_keyframe (trajectory* log) {
+    const dm_index k = log->size / TRAJECTORY_KEYFRAME_INTERVAL;
+    if (k == log->keyframeCapacity) {
+        const dm_index c = log->keyframeCapacity == 0 ? 4 : log->keyframeCapacity * 2;
+        block* newIndex = dmalloc_array(2 * c);
+        if (newIndex == NULL) {
+            return NO;
+        }
+        for (dm_index i = 0; i < 2 * log->keyframeCapacity; i++) {
+            newIndex[i] = log->keyframes[i];
+        }
+        if (log->keyframes != NULL) {
+            dmfree_array(log->keyframes, 2 * log->keyframeCapacity);
+        }
+        log->keyframes = newIndex;
+        log->keyframeCapacity = c;
+    }
+
+    // Keyframe must start in the segment it is recorded against.
+    if (!__trajectory_reserve(log)) {
+        return NO;
+    }
+    log->keyframes[2 * k] = (block)log->tail;
+    log->keyframes[2 * k + 1] = (block)(long)log->tailUsed;
+    __DM_MARK_DIRTY(&log->keyframes[2 * k], 2);
+    return YES;
+}
+
+// Appends a location to the end of the log.
+// Returns NO if d_memory ran out, in which case the entry is not recorded
+// and the log should not be appended to any further.
+__DM_HEADER_FUNCTION __bool trajectory_append (trajectory* log, location loc) {
+    point previous = log->last.position;
+    if (log->size % TRAJECTORY_KEYFRAME_INTERVAL == 0) {
+        if (!__trajectory_add_keyframe(log)) {
+            return NO;
+        }
+        previous = make_point(0, 0);
+    }
+
+    const int dx = loc.position.x - previous.x;
+    const int dy = loc.position.y - previous.y;
+    const byte heading = (byte)(loc.heading & 3);
+
+    // Check if the move lies along the heading axis.
+    __bool isAxis = YES;
+    int distance = 0;
+    switch (heading) {
+        case NORTH: isAxis = dx == 0; distance = dy;  break;
+        case EAST:  isAxis = dy == 0; distance = dx;  break;
+        case SOUTH: isAxis = dx == 0; distance = -dy; break;
+        case WEST:  isAxis = dy == 0; distance = -dx; break;
+    }
+
+    __bool isOK;
+    if (isAxis) {
+        const unsigned int z = __zigzag_encode(distance);
+        if (z < __TRAJECTORY_INLINE_MAX) {
+            isOK = __trajectory_put(log, (byte)(heading | __TRAJECTORY_AXIS_FLAG | ((z + 1) << 3)));
+        } else {
+            isOK = __trajectory_put(log, (byte)(heading | __TRAJECTORY_AXIS_FLAG))
+                && __trajectory_put_varint(log, z);
+        }
+    } else {
+        isOK = __trajectory_put(log, heading)
+            && __trajectory_put_varint(log, __zigzag_encode(dx))
+            && __trajectory_put_varint(log, __zigzag_encode(dy));
+    }
+
+    if (!isOK) {
+        return NO;
+    }
+    log->last = loc;
+    ++log->size;
+    return YES;
+}
+
+// Reads a single byte advancing to the next segment when needed.
+__DM_HEADER_FUNCTION byte __trajectory_get (trajectory_cursor* cursor) {
+    if (cursor->offset == (int)__TRAJECTORY_SEGMENT_BYTES) {
+        cursor->segment = (block*)cursor->segment[0];
+        cursor->offset = 0;
+    }
+    return __trajectory_data(cursor->segment)[cursor->offset++];
+}
+
+__DM_HEADER_FUNCTION unsigned int __trajectory_get_varint (trajectory_cursor* cursor) {
+    unsigned int value = 0;
+    int shift = 0;
+    byte b;
+    do {
+        b = __trajectory_get(cursor);
+        value |= (unsigned int)(b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    return value;
+}
+
+// Returns a cursor positioned at the keyframe with index k.
+__DM_HEADER_FUNCTION trajectory_cursor __trajectory_seek_keyframe (trajectory* log, dm_index k) {
+    trajectory_cursor cursor;
+    cursor.segment = (block*)log->keyframes[2 * k];
+    cursor.offset = (int)(long)log->keyframes[2 * k + 1];
+    cursor.index = k * TRAJECTORY_KEYFRAME_INTERVAL;
+    cursor.current.position = make_point(0, 0);
+    cursor.current.heading = NORTH;
+    return cursor;
+}
+
+// Returns a cursor positioned at the start of the log.
+__DM_HEADER_FUNCTION trajectory_cursor trajectory_begin (trajectory* log) {
+    if (log->size == 0) {
+        trajectory_cursor cursor;
+        cursor.segment = NULL;
+        cursor.offset = 0;
+        cursor.index = 0;
+        cursor.current.position = make_point(0, 0);
+        cursor.current.heading = NORTH;
+        return cursor;
+    }
+    return __trajectory_seek_keyframe(log, 0);
+}
+
+// Decodes the next entry into 'out'.
+// Returns NO once the end of the log has been reached.
+__DM_HEADER_FUNCTION __bool trajectory_next (trajectory* log, trajectory_cursor* cursor, location* out) {
+    if (cursor->index >= log->size) {
+        return NO;
+    }
+
+    point previous = cursor->current.position;
+    if (cursor->index % TRAJECTORY_KEYFRAME_INTERVAL == 0) {
+        previous = make_point(0, 0);
+    }
+
+    const byte header = __trajectory_get(cursor);
+    const direction heading = header & 3;
+    if (header & __TRAJECTORY_AXIS_FLAG) {
+        const unsigned int inlined = header >> 3;
+        const unsigned int z = inlined != 0 ? inlined - 1 : __trajectory_get_varint(cursor);
+        previous = add(previous, multiply(__zigzag_decode(z), directional_coefficient(heading)));
+    } else {
+        const int dx = __zigzag_decode(__trajectory_get_varint(cursor));
+        const int dy = __zigzag_decode(__trajectory_get_varint(cursor));
+        previous = add(previous, make_point(dx, dy));
+    }
+
+    cursor->current.position = previous;
+    cursor->current.heading = heading;
+    ++cursor->index;
+    *out = cursor->current;
+    return YES;
+}
+
+// Returns the location at entry idx.
+// Decodes forward from the closest keyframe before idx.  An idx past the
+// end is clamped to the last entry, an empty log returns (0, 0) facing NORTH.
+__DM_HEADER_FUNCTION location trajectory_at (trajectory* log, dm_index idx) {
+    if (log->size == 0) {
+        return trajectory_begin(log).current;
+    }
+    if (idx >= log->size) {
+        idx = log->size - 1;
+    }
+    if (idx < 0) {
+        idx = 0;
+    }
+    trajectory_cursor cursor = __trajectory_seek_keyframe(log, idx / TRAJECTORY_KEYFRAME_INTERVAL);
+    location loc = cursor.current;
+    while (cursor.index <= idx) {
+        trajectory_next(log, &cursor, &loc);
+    }
+    return loc;
+}
+
+// Returns the number of bytes of d_memory used by the log.
+__DM_HEADER_FUNCTION long long trajectory_memory_used (trajectory* log) {
+    return (long long)(log->segments * TRAJECTORY_SEGMENT_BLOCKS + 2 * log->keyframeCapacity)
+        * (long long)sizeof(block);
+}
+
+// Un-allocates all segments and the keyframe index.
+__DM_HEADER_FUNCTION void delete_trajectory (trajectory* log) {
+    block* segment = log->head;
+    while (segment != NULL) {
+        block* next = (block*)segment[0];
+        dmfree_array(segment, TRAJECTORY_SEGMENT_BLOCKS);
+        segment = next;
+    }
+    if (log->keyframes != NULL) {
+        dmfree_array(log->keyframes, 2 * log->keyframeCapacity);
+    }
+    *log = make_trajectory();
+}
+
+#endif